@@ -9,6 +9,8 @@
  */
 #pragma once
 
+#include <algorithm>
+#include <new>
 #include <utility>
 #include <type_traits>
 #include <hwmalloc/fancy_ptr/ptr.hpp>
@@ -45,6 +47,7 @@ class allocator
 
     Heap*       m_heap;
     std::size_t m_numa_node;
+    std::size_t m_alignment = 0u; // in addition to alignof(T), kept when rebinding
 
   public:
     allocator() noexcept
@@ -53,9 +56,10 @@ class allocator
         m_numa_node = 0;
     }
 
-    allocator(Heap* heap, std::size_t numa_node) noexcept
+    allocator(Heap* heap, std::size_t numa_node, std::size_t alignment = 0u) noexcept
     : m_heap{heap}
     , m_numa_node{numa_node}
+    , m_alignment{alignment}
     {
     }
 
@@ -63,6 +67,7 @@ class allocator
     allocator(const allocator<U, Heap>& other) noexcept
     : m_heap{other.m_heap}
     , m_numa_node{other.m_numa_node}
+    , m_alignment{other.m_alignment}
     {
     }
 
@@ -70,6 +75,7 @@ class allocator
     allocator(allocator<U, Heap>&& other) noexcept
     : m_heap{other.m_heap}
     , m_numa_node{other.m_numa_node}
+    , m_alignment{other.m_alignment}
     {
     }
 
@@ -78,6 +84,7 @@ class allocator
     {
         m_heap = other.m_heap;
         m_numa_node = other.m_numa_node;
+        m_alignment = other.m_alignment;
         return *this;
     }
 
@@ -86,12 +93,16 @@ class allocator
     {
         m_heap = other.m_heap;
         m_numa_node = other.m_numa_node;
+        m_alignment = other.m_alignment;
         return *this;
     }
 
+    std::size_t alignment() const noexcept { return std::max(m_alignment, alignof(T)); }
+
     pointer allocate(size_type n) //, const_void_pointer = const_void_pointer())
     {
-        return static_cast<pointer>(m_heap->allocate(n * sizeof(T), m_numa_node));
+        return static_cast<pointer>(
+            m_heap->allocate(n * sizeof(T), std::align_val_t(alignment()), m_numa_node));
     }
 
     void deallocate(pointer const& p, size_type) { m_heap->free(static_cast<void_pointer>(p)); }
@@ -102,12 +113,13 @@ class allocator
 
     friend bool operator==(const allocator& lhs, const allocator& rhs) noexcept
     {
-        return (lhs.m_heap == rhs.m_heap) && (lhs.m_numa_node == rhs.numa_node);
+        return (lhs.m_heap == rhs.m_heap) && (lhs.m_numa_node == rhs.m_numa_node) &&
+               (lhs.m_alignment == rhs.m_alignment);
     }
 
     friend bool operator!=(const allocator& lhs, const allocator& rhs) noexcept
     {
-        return (lhs.m_heap != rhs.m_heap) || (lhs.m_numa_node != rhs.numa_node);
+        return !(lhs == rhs);
     }
 
     friend void swap(allocator& lhs, allocator& rhs) noexcept
@@ -115,6 +127,7 @@ class allocator
         using std::swap;
         swap(lhs.m_heap, rhs.m_heap);
         swap(lhs.m_numa_node, rhs.m_numa_node);
+        swap(lhs.m_alignment, rhs.m_alignment);
     }
 };
 
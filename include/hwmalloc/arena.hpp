@@ -0,0 +1,122 @@
+/*
+ * ghex-org
+ *
+ * Copyright (c) 2014-2023, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <hwmalloc/config.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace hwmalloc
+{
+// Monotonic arena over registered memory, e.g. scratch space for the messages of one
+// communication epoch. Large blocks are taken from the heap, and buffers are carved from them by
+// bumping an offset: every buffer is a non-owning pointer with its own handles (see
+// heap::sub_pointer), so it can be used for RMA like any other allocation. Freeing a buffer has no
+// effect; reset() makes all buffers invalid at once and starts over with the first block. The
+// blocks are kept until the arena is destroyed. Not thread safe.
+template<typename Heap>
+class arena
+{
+  public:
+    using pointer = typename Heap::pointer;
+
+  private:
+    Heap*       m_heap;
+    std::size_t m_block_size;
+    std::size_t m_numa_node;
+#if HWMALLOC_ENABLE_DEVICE
+    int m_device_id = -1; // host only
+#endif
+    std::vector<std::pair<pointer, std::size_t>> m_blocks; // and their sizes
+    std::size_t                                  m_current = 0; // block in use
+    std::size_t                                  m_offset = 0;  // within the block in use
+
+  public:
+    // block_size: size of the blocks taken from the heap (larger buffers get blocks of their own)
+    arena(Heap& heap, std::size_t block_size, std::size_t numa_node)
+    : m_heap{&heap}
+    , m_block_size{block_size}
+    , m_numa_node{numa_node}
+    {
+    }
+
+#if HWMALLOC_ENABLE_DEVICE
+    // buffers mirrored on a device (see heap::allocate)
+    arena(Heap& heap, std::size_t block_size, std::size_t numa_node, int device_id)
+    : m_heap{&heap}
+    , m_block_size{block_size}
+    , m_numa_node{numa_node}
+    , m_device_id{device_id}
+    {
+    }
+#endif
+
+    arena(arena const&) = delete;
+
+    ~arena()
+    {
+        for (auto& b : m_blocks) m_heap->free(b.first);
+    }
+
+    pointer allocate(std::size_t size, std::size_t alignment = alignof(std::max_align_t))
+    {
+        while (true)
+        {
+            if (m_current < m_blocks.size())
+            {
+                auto const& b = m_blocks[m_current];
+                const auto  base = reinterpret_cast<std::uintptr_t>(b.first.get());
+                const auto  first =
+                    (base + m_offset + alignment - 1u) / alignment * alignment - base;
+                if (first + size <= b.second)
+                {
+                    m_offset = first + size;
+                    return m_heap->sub_pointer(b.first, first, size);
+                }
+                // the rest of the block is wasted until the next reset
+                ++m_current;
+                m_offset = 0u;
+            }
+            else
+                add_block(std::max(m_block_size, size + alignment));
+        }
+    }
+
+    // make all buffers invalid
+    void reset() noexcept
+    {
+        m_current = 0u;
+        m_offset = 0u;
+    }
+
+    // total size of the blocks
+    std::size_t capacity() const noexcept
+    {
+        std::size_t n = 0u;
+        for (auto const& b : m_blocks) n += b.second;
+        return n;
+    }
+
+  private:
+    void add_block(std::size_t size)
+    {
+#if HWMALLOC_ENABLE_DEVICE
+        if (m_device_id >= 0)
+            m_blocks.emplace_back(m_heap->allocate(size, m_numa_node, m_device_id), size);
+        else
+#endif
+            m_blocks.emplace_back(m_heap->allocate(size, m_numa_node), size);
+    }
+};
+
+} // namespace hwmalloc
@@ -40,21 +40,38 @@ struct block_t
     void*              m_device_ptr = nullptr;
     device_handle_type m_device_handle = device_handle_type();
     int                m_device_id = 0;
+#endif
+    // sub-blocks refer to the segment or user allocation they are part of, but do not own it
+    bool m_owning = true;
 
+#if HWMALLOC_ENABLE_DEVICE
     bool on_device() const noexcept { return m_device_ptr; }
 #else
     bool on_device() const noexcept { return false; }
 #endif
 
-    void release_from_segment() const noexcept;
-    void release_user_allocation() const noexcept;
+    void    release_from_segment() const noexcept;
+    void    release_user_allocation() const noexcept;
+    block_t sub_block_of_segment(std::size_t offset, std::size_t size) const noexcept;
+    block_t sub_block_of_user_allocation(std::size_t offset, std::size_t size) const noexcept;
 
     void release() const noexcept
     {
+        if (!m_owning) return;
         if (m_segment) release_from_segment();
         else if (m_user_allocation)
             release_user_allocation();
     }
+
+    // the part [offset, offset + size) of the block with its own handles, not owning
+    // sub-blocks can be divided again (null for blocks of neither a segment nor a user allocation)
+    block_t sub_block(std::size_t offset, std::size_t size) const noexcept
+    {
+        if (m_segment) return sub_block_of_segment(offset, size);
+        else if (m_user_allocation)
+            return sub_block_of_user_allocation(offset, size);
+        return {};
+    }
 };
 
 } // namespace detail
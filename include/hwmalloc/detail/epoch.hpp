@@ -0,0 +1,119 @@
+/*
+ * ghex-org
+ *
+ * Copyright (c) 2014-2023, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace hwmalloc
+{
+namespace detail
+{
+// Epoch-based reclamation of objects which lock-free code paths may still reference.
+// Threads access such objects only inside a critical section (epoch_guard), which announces the
+// global epoch at entry. An object which has become unreachable is retired with a stamp from
+// epoch_retire(), and may be destroyed once epoch_safe(stamp) holds: every thread is then either
+// outside any critical section or has entered one after the object was retired.
+class epoch_manager
+{
+  private:
+    struct alignas(64) record
+    {
+        std::atomic<std::uint64_t> m_epoch{0}; // 0: not in a critical section
+        std::atomic<bool>          m_in_use{true};
+        record*                    m_next = nullptr;
+        unsigned                   m_depth = 0;
+    };
+
+    // a thread's record, given back when the thread exits
+    struct thread_state
+    {
+        record* m_record = nullptr;
+
+        ~thread_state()
+        {
+            if (m_record) m_record->m_in_use.store(false, std::memory_order_release);
+            m_record = nullptr;
+        }
+    };
+
+    std::atomic<std::uint64_t> m_epoch{1};
+    std::atomic<record*>       m_records{nullptr}; // never shrinks, records are reused
+
+    record* acquire_record()
+    {
+        for (auto r = m_records.load(std::memory_order_acquire); r; r = r->m_next)
+        {
+            bool in_use = false;
+            if (!r->m_in_use.load(std::memory_order_relaxed) &&
+                r->m_in_use.compare_exchange_strong(in_use, true, std::memory_order_acquire))
+                return r;
+        }
+        auto r = new record;
+        r->m_next = m_records.load(std::memory_order_relaxed);
+        while (!m_records.compare_exchange_weak(r->m_next, r, std::memory_order_release,
+            std::memory_order_relaxed)) {}
+        return r;
+    }
+
+    record& thread_record()
+    {
+        static thread_local thread_state s;
+        if (!s.m_record) s.m_record = acquire_record();
+        return *s.m_record;
+    }
+
+  public:
+    // never destroyed: threads and static objects may still use it during shutdown
+    static epoch_manager& instance()
+    {
+        static epoch_manager* m = new epoch_manager;
+        return *m;
+    }
+
+    void enter()
+    {
+        auto& r = thread_record();
+        if (r.m_depth++ == 0) r.m_epoch.store(m_epoch.load(), std::memory_order_seq_cst);
+    }
+
+    void exit()
+    {
+        auto& r = thread_record();
+        if (--r.m_depth == 0) r.m_epoch.store(0u, std::memory_order_release);
+    }
+
+    // stamp for an object which has just become unreachable, later critical sections announce a
+    // larger epoch
+    std::uint64_t retire() noexcept { return m_epoch.fetch_add(1u, std::memory_order_seq_cst); }
+
+    // true if no thread can still reference an object retired with the given stamp
+    bool is_safe(std::uint64_t stamp) const noexcept
+    {
+        for (auto r = m_records.load(std::memory_order_acquire); r; r = r->m_next)
+        {
+            const auto e = r->m_epoch.load(std::memory_order_seq_cst);
+            if (e != 0u && e <= stamp) return false;
+        }
+        return true;
+    }
+};
+
+// critical section of the calling thread
+class epoch_guard
+{
+  public:
+    epoch_guard() { epoch_manager::instance().enter(); }
+    epoch_guard(epoch_guard const&) = delete;
+    ~epoch_guard() { epoch_manager::instance().exit(); }
+};
+
+} // namespace detail
+} // namespace hwmalloc
@@ -11,6 +11,10 @@
 
 #include <hwmalloc/detail/pool.hpp>
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <mutex>
 
 namespace hwmalloc
 {
@@ -22,14 +26,23 @@ class fixed_size_heap
   public:
     using pool_type = pool<Context>;
     using block_type = typename pool_type::block_type;
+    using memory_tier = numa_tools::memory_tier;
+    using segment_table_ptr = typename pool_type::segment_table_ptr;
 
   private:
+    static constexpr std::size_t s_num_tiers = 3;
+    static constexpr std::size_t s_no_node = std::numeric_limits<std::size_t>::max();
+
     Context*                                m_context;
     std::size_t                             m_block_size;
     std::size_t                             m_segment_size;
-    bool                                    m_never_free;
-    std::size_t                             m_num_reserve_segments;
+    heap_config                             m_config;
+    segment_table_ptr                       m_segment_table;
     std::vector<std::unique_ptr<pool_type>> m_pools;
+    std::vector<std::unique_ptr<pool_type>> m_memory_pools; // created on first use
+    std::vector<std::size_t>                m_tier_nodes;   // per local node and tier
+    std::vector<std::atomic<pool_type*>>    m_tier_pools;
+    mutable std::mutex                      m_memory_pools_mutex;
 #if HWMALLOC_ENABLE_DEVICE
     std::size_t                             m_num_devices;
     std::vector<std::unique_ptr<pool_type>> m_device_pools;
@@ -37,12 +50,12 @@ class fixed_size_heap
 
   public:
     fixed_size_heap(Context* context, std::size_t block_size, std::size_t segment_size,
-        bool never_free, std::size_t num_reserve_segments)
+        heap_config const& config)
     : m_context(context)
     , m_block_size(block_size)
     , m_segment_size(segment_size)
-    , m_never_free(never_free)
-    , m_num_reserve_segments{num_reserve_segments}
+    , m_config(config)
+    , m_segment_table(pool_type::make_segment_table(block_size, segment_size, config))
     , m_pools(numa().local_nodes().size())
 #if HWMALLOC_ENABLE_DEVICE
     , m_num_devices{(std::size_t)get_num_devices()}
@@ -52,25 +65,36 @@ class fixed_size_heap
         for (auto [n, i] : numa().local_nodes())
         {
             m_pools[i] = std::make_unique<pool_type>(m_context, m_block_size, m_segment_size, n,
-                m_never_free, m_num_reserve_segments);
+                m_config, m_segment_table);
 #if HWMALLOC_ENABLE_DEVICE
             for (unsigned int j = 0; j < m_num_devices; ++j)
             {
                 m_device_pools[i * m_num_devices + j] = std::make_unique<pool_type>(m_context,
-                    m_block_size, m_segment_size, n, (int)j, m_never_free, m_num_reserve_segments);
+                    m_block_size, m_segment_size, n, (int)j, m_config, m_segment_table);
             }
 #endif
         }
+        find_tier_nodes();
+    }
+
+    fixed_size_heap(Context* context, std::size_t block_size, std::size_t segment_size,
+        bool never_free, std::size_t num_reserve_segments)
+    : fixed_size_heap(
+          context, block_size, segment_size, heap_config{never_free, num_reserve_segments})
+    {
     }
 
     fixed_size_heap(fixed_size_heap const&) = delete;
-    fixed_size_heap(fixed_size_heap&&) = default;
+    fixed_size_heap(fixed_size_heap&&) = delete;
 
     block_type allocate(std::size_t numa_node)
     {
         return m_pools[numa_node_index(numa_node)]->allocate();
     }
 
+    // allocate on the calling thread's numa node
+    block_type allocate() { return m_pools[numa().local_node_index()]->allocate(); }
+
 #if HWMALLOC_ENABLE_DEVICE
     block_type allocate(std::size_t numa_node, int device_id)
     {
@@ -78,15 +102,110 @@ class fixed_size_heap
     }
 #endif
 
+    // allocate on the nearest node of the given tier as seen from numa_node
+    // falls back to dram when there is no such node or when it is out of memory
+    block_type allocate(std::size_t numa_node, memory_tier tier)
+    {
+        const auto i = numa_node_index(numa_node);
+        if (tier != memory_tier::dram)
+        {
+            block_type b;
+            auto       p = get_tier_pool(i * s_num_tiers + (std::size_t)tier);
+            if (p && p->try_allocate(b)) return b;
+        }
+        return m_pools[i]->allocate();
+    }
+
     void free(block_type const& b) { b.release(); }
 
+    // pool of the local node with the given index (see numa_tools::local_nodes)
+    pool_type* get_pool(std::size_t node_index) const noexcept { return m_pools[node_index].get(); }
+
+#if HWMALLOC_ENABLE_DEVICE
+    pool_type* get_device_pool(std::size_t node_index, int device_id) const noexcept
+    {
+        return m_device_pools[node_index * m_num_devices + device_id].get();
+    }
+#endif
+
+    // move the segments of the pools on node_from to the pools on node_to
+    // both nodes must be local nodes, returns the number of migrated segments
+    std::size_t migrate(std::size_t node_from, std::size_t node_to)
+    {
+        auto from = numa().local_nodes().find(node_from);
+        auto to = numa().local_nodes().find(node_to);
+        if (from == numa().local_nodes().end() || to == numa().local_nodes().end()) return 0u;
+        const auto  i = from->second;
+        const auto  j = to->second;
+        std::size_t n = m_pools[i]->migrate(*m_pools[j]);
+#if HWMALLOC_ENABLE_DEVICE
+        for (unsigned int k = 0; k < m_num_devices; ++k)
+            n += m_device_pools[i * m_num_devices + k]->migrate(
+                *m_device_pools[j * m_num_devices + k]);
+#endif
+        return n;
+    }
+
+    // alignment of all blocks (see pool::alignment)
+    std::size_t alignment() const noexcept { return m_pools[0]->alignment(); }
+
+    std::size_t num_fallback_segments() const noexcept
+    {
+        std::size_t n = 0;
+        for (auto& p : m_pools) n += p->num_fallback_segments();
+        std::lock_guard<std::mutex> lock(m_memory_pools_mutex);
+        for (auto& p : m_memory_pools) n += p->num_fallback_segments();
+#if HWMALLOC_ENABLE_DEVICE
+        for (auto& p : m_device_pools) n += p->num_fallback_segments();
+#endif
+        return n;
+    }
+
   private:
+    // for each local node and tier the nearest node of that tier (pools on these cpu-less memory
+    // nodes are created on first use and shared among local nodes)
+    void find_tier_nodes()
+    {
+        m_tier_nodes.assign(m_pools.size() * s_num_tiers, s_no_node);
+        m_tier_pools = std::vector<std::atomic<pool_type*>>(m_tier_nodes.size());
+        for (auto [n, i] : numa().local_nodes())
+        {
+            for (auto tier : {memory_tier::hbm, memory_tier::cxl})
+            {
+                auto const& nearest = numa().nearest_nodes(n);
+                auto        it = std::find_if(nearest.begin(), nearest.end(),
+                    [tier](auto m) { return numa().tier_of(m) == tier; });
+                if (it != nearest.end()) m_tier_nodes[i * s_num_tiers + (std::size_t)tier] = *it;
+            }
+        }
+    }
+
+    // pool for slot k of m_tier_nodes, nullptr if there is no such node
+    pool_type* get_tier_pool(std::size_t k)
+    {
+        if (auto p = m_tier_pools[k].load(std::memory_order_acquire)) return p;
+        const auto node = m_tier_nodes[k];
+        if (node == s_no_node) return nullptr;
+        std::lock_guard<std::mutex> lock(m_memory_pools_mutex);
+        auto it = std::find_if(m_memory_pools.begin(), m_memory_pools.end(),
+            [node](auto const& p) { return p->numa_node() == node; });
+        if (it == m_memory_pools.end())
+        {
+            auto config = m_config;
+            config.numa_placement = numa_tools::placement::bind;
+            config.numa_fallback = false;
+            m_memory_pools.push_back(std::make_unique<pool_type>(m_context, m_block_size,
+                m_segment_size, node, config, m_segment_table));
+            it = m_memory_pools.end() - 1;
+        }
+        m_tier_pools[k].store(it->get(), std::memory_order_release);
+        return it->get();
+    }
+
     auto numa_node_index(std::size_t numa_node) const noexcept
     {
         auto it = numa().local_nodes().find(numa_node);
-        return (it != numa().local_nodes().end()
-                    ? it->second
-                    : numa().local_nodes().find(numa().local_node())->second);
+        return (it != numa().local_nodes().end() ? it->second : numa().local_node_index());
     }
 };
 
@@ -0,0 +1,345 @@
+/*
+ * ghex-org
+ *
+ * Copyright (c) 2014-2023, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <hwmalloc/detail/node_arena.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace hwmalloc
+{
+namespace detail
+{
+// Slots of the segments of a fixed block size, shared by the pools of a fixed_size_heap.
+// A block is identified by a 32-bit id made of its segment's slot and its index within the
+// segment. Free blocks are linked through one next-id per block, stored in an array owned by the
+// slot: a free block costs 4 bytes of metadata. The arrays are kept when a segment is released and
+// reused by the next segment in the same slot, so that concurrent pops may still read them.
+// A table without links has no next-id arrays: its segments track their free blocks in bitmaps.
+// The table also owns the node arenas holding the metadata of the pools and segments.
+template<typename Segment>
+class segment_table
+{
+  public:
+    using id_type = std::uint32_t;
+    static constexpr id_type nil = ~id_type(0);
+
+  private:
+    static constexpr std::size_t s_chunk_bits = 12;
+    static constexpr std::size_t s_chunk_size = std::size_t(1) << s_chunk_bits;
+    static constexpr std::size_t s_max_chunks = 256;
+
+    struct slot
+    {
+        std::atomic<Segment*> m_segment{nullptr};
+        std::atomic<id_type>* m_next = nullptr; // allocated in the arena of the first segment
+        std::atomic<char*>    m_origin{nullptr}; // address of the first block
+    };
+
+    std::size_t                                  m_num_blocks;
+    bool                                         m_linked;
+    std::size_t                                  m_index_bits = 0;
+    id_type                                      m_index_mask;
+    std::size_t                                  m_max_slots;
+    std::array<std::atomic<slot*>, s_max_chunks> m_chunks;
+    std::mutex                                   m_mutex;
+    std::vector<id_type>                         m_free_slots;
+    std::size_t                                  m_num_slots = 0;
+
+    // metadata node -> arena
+    std::map<std::size_t, std::unique_ptr<node_arena>> m_arenas;
+
+  public:
+    // num_blocks: number of blocks per segment
+    // linked: allocate next-ids for the blocks (free lists)
+    segment_table(std::size_t num_blocks, bool linked = true)
+    : m_num_blocks{num_blocks}
+    , m_linked{linked}
+    {
+        while ((std::size_t(1) << m_index_bits) < m_num_blocks) ++m_index_bits;
+        if (m_index_bits >= 32) throw std::invalid_argument("too many blocks per segment");
+        m_index_mask = (id_type)((std::uint64_t(1) << m_index_bits) - 1);
+        // the highest id is reserved for nil
+        m_max_slots = std::min<std::uint64_t>(s_chunk_size * s_max_chunks,
+            (std::uint64_t(1) << (32 - m_index_bits)) - 1);
+        for (auto& c : m_chunks) c.store(nullptr, std::memory_order_relaxed);
+    }
+
+    segment_table(segment_table const&) = delete;
+
+    ~segment_table()
+    {
+        for (auto& c : m_chunks) delete[] c.load();
+    }
+
+    std::size_t num_blocks() const noexcept { return m_num_blocks; }
+    bool        linked() const noexcept { return m_linked; }
+
+    // arena for the metadata of pools and segments on the given node
+    node_arena& arena(std::size_t node)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return get_arena(node);
+    }
+
+    // assign a slot to a segment on the given node whose first block is at origin
+    // returns the id of the segment's first block
+    id_type acquire(Segment* s, std::size_t node, char* origin)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        id_type                     i;
+        if (!m_free_slots.empty())
+        {
+            i = m_free_slots.back();
+            m_free_slots.pop_back();
+        }
+        else
+        {
+            if (m_num_slots == m_max_slots) throw std::runtime_error("too many segments");
+            i = (id_type)m_num_slots++;
+            auto& c = m_chunks[i >> s_chunk_bits];
+            if (!c.load(std::memory_order_relaxed))
+                c.store(new slot[s_chunk_size], std::memory_order_release);
+            if (!m_linked) return assign(i, s, origin);
+            get(i).m_next = node_allocator<std::atomic<id_type>>(get_arena(node)).allocate(
+                m_num_blocks);
+            for (std::size_t k = 0; k < m_num_blocks; ++k)
+                new (get(i).m_next + k) std::atomic<id_type>(nil);
+        }
+        return assign(i, s, origin);
+    }
+
+    // give the slot of the segment with first block id back
+    void release(id_type id) noexcept
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        get(id >> m_index_bits).m_segment.store(nullptr, std::memory_order_relaxed);
+        m_free_slots.push_back(id >> m_index_bits);
+    }
+
+    Segment* segment(id_type id) const noexcept
+    {
+        return get(id >> m_index_bits).m_segment.load(std::memory_order_relaxed);
+    }
+
+    std::size_t index(id_type id) const noexcept { return id & m_index_mask; }
+
+    // address of the first block of the segment with first block id
+    // slots are never freed: may be read for prefetching while the segment is released
+    char* origin(id_type id) const noexcept
+    {
+        return get(id >> m_index_bits).m_origin.load(std::memory_order_relaxed);
+    }
+
+    // next-ids of the blocks of the segment with first block id (nullptr without links)
+    std::atomic<id_type>* next_array(id_type id) const noexcept
+    {
+        return get(id >> m_index_bits).m_next;
+    }
+
+    std::atomic<id_type>& next(id_type id) const noexcept
+    {
+        return get(id >> m_index_bits).m_next[id & m_index_mask];
+    }
+
+  private:
+    id_type assign(id_type i, Segment* s, char* origin) noexcept
+    {
+        get(i).m_segment.store(s, std::memory_order_relaxed);
+        get(i).m_origin.store(origin, std::memory_order_relaxed);
+        return i << m_index_bits;
+    }
+
+    node_arena& get_arena(std::size_t node)
+    {
+        auto& a = m_arenas[metadata_node(node)];
+        if (!a) a = std::make_unique<node_arena>(metadata_node(node));
+        return *a;
+    }
+
+    slot& get(id_type i) const noexcept
+    {
+        return m_chunks[i >> s_chunk_bits].load(std::memory_order_acquire)[i & (s_chunk_size - 1)];
+    }
+};
+
+// Lock-free stack of block ids, linked through the next-ids of a segment_table.
+// The head holds the top id and a tag which changes with every operation (ABA protection).
+template<typename Segment>
+class alignas(64) free_list
+{
+  public:
+    using table_type = segment_table<Segment>;
+    using id_type = typename table_type::id_type;
+
+  private:
+    std::atomic<std::uint64_t> m_head;
+    table_type*                m_table;
+
+    static std::uint64_t pack(id_type id, std::uint64_t tag) noexcept { return (tag << 32) | id; }
+    static id_type       top(std::uint64_t head) noexcept { return (id_type)head; }
+    static std::uint64_t tag(std::uint64_t head) noexcept { return head >> 32; }
+
+  public:
+    free_list(table_type& table) noexcept
+    : m_head{pack(table_type::nil, 0u)}
+    , m_table{&table}
+    {
+    }
+
+    free_list(free_list const&) = delete;
+
+    table_type& table() const noexcept { return *m_table; }
+
+    bool empty() const noexcept
+    {
+        return top(m_head.load(std::memory_order_relaxed)) == table_type::nil;
+    }
+
+    // id on top, or nil (may be stale)
+    id_type peek() const noexcept { return top(m_head.load(std::memory_order_relaxed)); }
+
+    // push a chain of blocks which are already linked from first to last
+    void push(id_type first, id_type last) noexcept
+    {
+        auto& next = m_table->next(last);
+        auto  h = m_head.load(std::memory_order_relaxed);
+        do
+        {
+            next.store(top(h), std::memory_order_relaxed);
+        } while (!m_head.compare_exchange_weak(h, pack(first, tag(h) + 1),
+            std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    bool pop(id_type& id) noexcept
+    {
+        auto h = m_head.load(std::memory_order_acquire);
+        while (top(h) != table_type::nil)
+        {
+            // may read a stale next-id if the block is popped concurrently: the tag then differs
+            const auto next = m_table->next(top(h)).load(std::memory_order_relaxed);
+            if (m_head.compare_exchange_weak(h, pack(next, tag(h) + 1),
+                    std::memory_order_acquire, std::memory_order_acquire))
+            {
+                id = top(h);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Elimination array in front of a pool's free lists.
+// A thread which frees a block under contention offers its id in a random slot and waits a little;
+// allocating threads take offered ids directly, so that a free and an allocation pair up without
+// touching any list head. The waiting time adapts: it doubles when an offer is taken and halves
+// when an offer times out. Each slot holds an id (or nil) and a tag which changes with every offer.
+class elimination_array
+{
+  public:
+    using id_type = std::uint32_t;
+    static constexpr id_type nil = ~id_type(0);
+
+  private:
+    static constexpr unsigned s_min_spin = 2u;
+
+    struct alignas(64) slot
+    {
+        std::atomic<std::uint64_t> m_value{pack(nil, 0u)};
+    };
+
+    std::vector<slot, node_allocator<slot>> m_slots;
+    unsigned                                m_max_spin;
+    std::atomic<unsigned>                   m_spin;
+
+    static std::uint64_t pack(id_type id, std::uint64_t tag) noexcept { return (tag << 32) | id; }
+    static id_type       top(std::uint64_t value) noexcept { return (id_type)value; }
+    static std::uint64_t tag(std::uint64_t value) noexcept { return value >> 32; }
+
+    static void cpu_relax() noexcept
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    // per-thread xorshift generator
+    static std::size_t next_random() noexcept
+    {
+        static thread_local std::uint32_t x =
+            0x9e3779b9u ^ (std::uint32_t)reinterpret_cast<std::uintptr_t>(&x);
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return x;
+    }
+
+  public:
+    // num_slots == 0 disables elimination
+    // max_spin: upper bound of the pause instructions a free waits for its offer to be taken
+    elimination_array(std::size_t num_slots, node_arena& arena, unsigned max_spin)
+    : m_slots(num_slots, node_allocator<slot>(arena))
+    , m_max_spin{max_spin}
+    , m_spin{std::min(s_min_spin, max_spin)}
+    {
+    }
+
+    bool enabled() const noexcept { return !m_slots.empty(); }
+
+    // returns true if the id was taken by another thread
+    bool offer(id_type id) noexcept
+    {
+        auto& s = m_slots[next_random() % m_slots.size()].m_value;
+        auto  v = s.load(std::memory_order_relaxed);
+        if (top(v) != nil) return false;
+        const auto offered = pack(id, tag(v) + 1);
+        if (!s.compare_exchange_strong(v, offered, std::memory_order_release,
+                std::memory_order_relaxed))
+            return false;
+        const auto spin = m_spin.load(std::memory_order_relaxed);
+        for (unsigned i = 0; i < spin && s.load(std::memory_order_relaxed) == offered; ++i)
+            cpu_relax();
+        // withdraw the offer unless it was taken
+        v = offered;
+        if (s.compare_exchange_strong(v, pack(nil, tag(offered)), std::memory_order_relaxed))
+        {
+            if (spin > s_min_spin) m_spin.store(spin / 2, std::memory_order_relaxed);
+            return false;
+        }
+        if (spin < m_max_spin)
+            m_spin.store(std::min(spin * 2, m_max_spin), std::memory_order_relaxed);
+        return true;
+    }
+
+    // take an offered id from a random slot
+    // only one slot is probed: the slots are written by freeing threads, and scanning all of them
+    // would cost a cache miss per slot on every allocation, even when nothing is offered
+    bool take(id_type& id) noexcept
+    {
+        auto& s = m_slots[next_random() % m_slots.size()].m_value;
+        auto  v = s.load(std::memory_order_relaxed);
+        if (top(v) == nil) return false;
+        if (!s.compare_exchange_strong(v, pack(nil, tag(v)), std::memory_order_acquire,
+                std::memory_order_relaxed))
+            return false;
+        id = top(v);
+        return true;
+    }
+};
+
+} // namespace detail
+} // namespace hwmalloc
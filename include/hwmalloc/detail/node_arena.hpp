@@ -0,0 +1,239 @@
+/*
+ * ghex-org
+ *
+ * Copyright (c) 2014-2023, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <hwmalloc/numa.hpp>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+
+namespace hwmalloc
+{
+namespace detail
+{
+// node which holds the metadata of memory on the given node: the node itself if it has cpus,
+// otherwise the nearest node with cpus (cpu-less nodes are only accessed from there)
+inline std::size_t
+metadata_node(std::size_t node) noexcept
+{
+    if (numa().host_nodes().count(node)) return node;
+    for (auto n : numa().nearest_nodes(node))
+        if (numa().host_nodes().count(n)) return n;
+    return node;
+}
+
+// Memory for the allocator's own data structures, taken from pages bound to one numa node.
+// Small requests are carved from single pages and recycled through per-size free lists, larger
+// requests get pages of their own. All pages are returned when the arena is destroyed.
+class node_arena
+{
+  private:
+    static constexpr std::size_t s_granularity = 16;
+    static constexpr std::size_t s_max_small = 512;
+    static constexpr std::size_t s_max_alignment = 64;
+
+    // pages obtained from numa_tools
+    struct pages
+    {
+        numa_tools::allocation m;
+        pages*                 m_next;
+    };
+
+    std::size_t                                    m_node;
+    std::mutex                                     m_mutex;
+    pages*                                         m_chunks = nullptr; // record at the start
+    pages*                                         m_large = nullptr;  // records are small blocks
+    char*                                          m_current = nullptr;
+    char*                                          m_end = nullptr;
+    std::array<void*, s_max_small / s_granularity> m_free = {};
+
+  public:
+    node_arena(std::size_t node) noexcept
+    : m_node{node}
+    {
+    }
+
+    node_arena(node_arena const&) = delete;
+
+    ~node_arena()
+    {
+        for (auto p = m_large; p;)
+        {
+            const auto m = p->m;
+            p = p->m_next;
+            numa().free(m);
+        }
+        for (auto p = m_chunks; p;)
+        {
+            const auto m = p->m;
+            p = p->m_next;
+            numa().free(m);
+        }
+    }
+
+    std::size_t numa_node() const noexcept { return m_node; }
+
+    void* allocate(std::size_t size, std::size_t alignment = alignof(std::max_align_t))
+    {
+        if (alignment > s_max_alignment) throw std::bad_alloc();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (size <= s_max_small) return allocate_small(size);
+        void* r = allocate_small(sizeof(pages));
+        try
+        {
+            auto m = get_pages((size + numa().page_size() - 1) / numa().page_size());
+            m_large = new (r) pages{m, m_large};
+            return m.ptr;
+        }
+        catch (...)
+        {
+            deallocate_small(r, sizeof(pages));
+            throw;
+        }
+    }
+
+    void deallocate(void* ptr, std::size_t size) noexcept
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (size <= s_max_small) return deallocate_small(ptr, size);
+        for (auto p = &m_large; *p; p = &(*p)->m_next)
+        {
+            if ((*p)->m.ptr != ptr) continue;
+            auto r = std::exchange(*p, (*p)->m_next);
+            numa().free(r->m);
+            r->~pages();
+            return deallocate_small(r, sizeof(pages));
+        }
+    }
+
+  private:
+    static std::size_t size_class(std::size_t size) noexcept
+    {
+        return size ? (size - 1) / s_granularity : 0u;
+    }
+
+    numa_tools::allocation get_pages(std::size_t num_pages)
+    {
+        if (auto m = numa().allocate(num_pages, m_node, numa_tools::placement::bind)) return m;
+        if (auto m = numa().allocate(num_pages)) return m;
+        throw std::bad_alloc();
+    }
+
+    // blocks whose size is a multiple of the maximum alignment are aligned to it
+    void* allocate_small(std::size_t size)
+    {
+        const auto c = size_class(size);
+        if (m_free[c]) return std::exchange(m_free[c], *static_cast<void**>(m_free[c]));
+        const auto bytes = (c + 1) * s_granularity;
+        const auto alignment = (bytes % s_max_alignment == 0u) ? s_max_alignment : s_granularity;
+        auto       p = align(m_current, alignment);
+        if (!m_current || p + bytes > m_end)
+        {
+            auto m = get_pages(1);
+            m_chunks = new (m.ptr) pages{m, m_chunks};
+            m_current = (char*)m.ptr + sizeof(pages);
+            m_end = (char*)m.ptr + m.size;
+            p = align(m_current, alignment);
+        }
+        m_current = p + bytes;
+        return p;
+    }
+
+    void deallocate_small(void* ptr, std::size_t size) noexcept
+    {
+        const auto c = size_class(size);
+        *static_cast<void**>(ptr) = m_free[c];
+        m_free[c] = ptr;
+    }
+
+    static char* align(char* p, std::size_t alignment) noexcept
+    {
+        const auto x = reinterpret_cast<std::uintptr_t>(p);
+        return p + ((alignment - x % alignment) % alignment);
+    }
+};
+
+// standard allocator drawing from a node_arena
+template<typename T>
+struct node_allocator
+{
+    using value_type = T;
+
+    node_arena* m_arena;
+
+    node_allocator(node_arena& arena) noexcept
+    : m_arena{&arena}
+    {
+    }
+
+    template<typename U>
+    node_allocator(node_allocator<U> const& other) noexcept
+    : m_arena{other.m_arena}
+    {
+    }
+
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(m_arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept { m_arena->deallocate(p, n * sizeof(T)); }
+
+    template<typename U>
+    bool operator==(node_allocator<U> const& other) const noexcept
+    {
+        return m_arena == other.m_arena;
+    }
+
+    template<typename U>
+    bool operator!=(node_allocator<U> const& other) const noexcept
+    {
+        return m_arena != other.m_arena;
+    }
+};
+
+template<typename T>
+struct node_deleter
+{
+    node_arena* m_arena = nullptr;
+
+    void operator()(T* p) const noexcept
+    {
+        p->~T();
+        m_arena->deallocate(p, sizeof(T));
+    }
+};
+
+// unique pointer to an object in a node_arena
+template<typename T>
+using node_ptr = std::unique_ptr<T, node_deleter<T>>;
+
+template<typename T, typename... Args>
+node_ptr<T>
+make_node_ptr(node_arena& arena, Args&&... args)
+{
+    void* p = arena.allocate(sizeof(T), alignof(T));
+    try
+    {
+        return node_ptr<T>(new (p) T(std::forward<Args>(args)...), node_deleter<T>{&arena});
+    }
+    catch (...)
+    {
+        arena.deallocate(p, sizeof(T));
+        throw;
+    }
+}
+
+} // namespace detail
+} // namespace hwmalloc
@@ -0,0 +1,129 @@
+/*
+ * ghex-org
+ *
+ * Copyright (c) 2014-2023, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+namespace hwmalloc
+{
+namespace detail
+{
+// Map from the 4KiB pages of the segments to the segments, for looking up the block of a raw
+// pointer. A radix tree over the page numbers of 48-bit addresses with three levels of 4096
+// entries; nodes are created on demand and never freed, lookups are lock-free.
+template<typename Segment>
+class page_map
+{
+  private:
+    static constexpr std::size_t s_page_shift = 12;
+    static constexpr std::size_t s_bits = 12;
+    static constexpr std::size_t s_fanout = std::size_t(1) << s_bits;
+    static constexpr std::size_t s_mask = s_fanout - 1;
+    static constexpr std::size_t s_max_page = std::size_t(1) << (3 * s_bits);
+
+    struct leaf
+    {
+        std::array<std::atomic<Segment*>, s_fanout> m_segments;
+    };
+
+    struct inner
+    {
+        std::array<std::atomic<leaf*>, s_fanout> m_leaves;
+    };
+
+    std::array<std::atomic<inner*>, s_fanout> m_root;
+    std::mutex                                m_mutex; // creation of nodes
+
+    page_map() noexcept
+    {
+        for (auto& x : m_root) x.store(nullptr, std::memory_order_relaxed);
+    }
+
+  public:
+    // never destroyed: segments may still be released during shutdown
+    static page_map& instance()
+    {
+        static page_map* m = new page_map;
+        return *m;
+    }
+
+    page_map(page_map const&) = delete;
+
+    // map the pages of [ptr, ptr + size) to s (nullptr: unmap)
+    // pages beyond 48-bit addresses are not mapped
+    void assign(void* ptr, std::size_t size, Segment* s)
+    {
+        const auto first = page(ptr);
+        const auto last = std::min(page((char*)ptr + size - 1) + 1, s_max_page);
+        for (auto i = first; i < last; ++i)
+        {
+            auto l = get_leaf(i, s != nullptr);
+            if (l) l->m_segments[i & s_mask].store(s, std::memory_order_release);
+        }
+    }
+
+    Segment* find(void const* ptr) const noexcept
+    {
+        const auto i = page(ptr);
+        if (i >= s_max_page) return nullptr;
+        auto n = m_root[i >> (2 * s_bits)].load(std::memory_order_acquire);
+        if (!n) return nullptr;
+        auto l = n->m_leaves[(i >> s_bits) & s_mask].load(std::memory_order_acquire);
+        if (!l) return nullptr;
+        return l->m_segments[i & s_mask].load(std::memory_order_acquire);
+    }
+
+  private:
+    static std::size_t page(void const* ptr) noexcept
+    {
+        return reinterpret_cast<std::uintptr_t>(ptr) >> s_page_shift;
+    }
+
+    // leaf of page i, created if requested
+    leaf* get_leaf(std::size_t i, bool create)
+    {
+        auto& r = m_root[i >> (2 * s_bits)];
+        auto  n = r.load(std::memory_order_acquire);
+        if (!n)
+        {
+            if (!create) return nullptr;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            n = r.load(std::memory_order_relaxed);
+            if (!n)
+            {
+                n = new inner;
+                for (auto& x : n->m_leaves) x.store(nullptr, std::memory_order_relaxed);
+                r.store(n, std::memory_order_release);
+            }
+        }
+        auto& e = n->m_leaves[(i >> s_bits) & s_mask];
+        auto  l = e.load(std::memory_order_acquire);
+        if (!l)
+        {
+            if (!create) return nullptr;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            l = e.load(std::memory_order_relaxed);
+            if (!l)
+            {
+                l = new leaf;
+                for (auto& x : l->m_segments) x.store(nullptr, std::memory_order_relaxed);
+                e.store(l, std::memory_order_release);
+            }
+        }
+        return l;
+    }
+};
+
+} // namespace detail
+} // namespace hwmalloc
@@ -10,9 +10,17 @@
 #pragma once
 
 #include <hwmalloc/detail/segment.hpp>
+#include <hwmalloc/detail/epoch.hpp>
+#include <hwmalloc/heap_config.hpp>
+#include <hwmalloc/log.hpp>
+#include <hwmalloc/trace.hpp>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <algorithm>
 #include <mutex>
 #include <memory>
+#include <shared_mutex>
 #include <stdexcept>
 
 namespace hwmalloc
@@ -24,45 +32,189 @@ class pool
 {
   public:
     using segment_type = segment<Context>;
+    using region_traits_type = typename segment_type::region_traits_type;
     using block_type = typename segment_type::block;
-    using stack_type = boost::lockfree::stack<block_type>;
-    using segment_map = std::unordered_map<segment_type*, std::unique_ptr<segment_type>>;
+    using free_list_type = typename segment_type::free_list_type;
+    using segment_table_type = typename free_list_type::table_type;
+    using id_type = typename free_list_type::id_type;
+    using segment_table_ptr = std::shared_ptr<segment_table_type>;
+    // the pool's metadata is allocated in the node arena of its numa node
+    using segment_ptr = node_ptr<segment_type>;
+    using segment_map = std::unordered_map<segment_type*, segment_ptr, std::hash<segment_type*>,
+        std::equal_to<segment_type*>, node_allocator<std::pair<segment_type* const, segment_ptr>>>;
+    // free lists of the last level cache domains
+    using shard_vector =
+        std::vector<node_ptr<free_list_type>, node_allocator<node_ptr<free_list_type>>>;
+    // segments with freed blocks and their occupancy bin
+    using bin_vector = std::vector<std::pair<std::size_t, segment_type*>,
+        node_allocator<std::pair<std::size_t, segment_type*>>>;
+
+    // bitmap engine: segment which the threads of a cache domain allocate from
+    struct alignas(64) active_segment
+    {
+        std::atomic<segment_type*> m_segment{nullptr};
+    };
+    using active_vector = std::vector<active_segment, node_allocator<active_segment>>;
+
+  private:
+    // liveness token of a pool, referenced by the per-thread remote free buffers
+    struct remote_free_token
+    {
+        std::shared_mutex mutex;
+        pool*             p;
+    };
+
+    // blocks freed by one thread on a remote node, destined for one pool
+    struct remote_free_buffer
+    {
+        std::shared_ptr<remote_free_token> token;
+        std::vector<block_type>            blocks;
+    };
+
+    // all remote free buffers of a thread, flushed when the thread exits
+    struct remote_free_cache
+    {
+        std::unordered_map<pool*, remote_free_buffer> buffers;
+
+        ~remote_free_cache()
+        {
+            for (auto& kvp : buffers) flush(kvp.second);
+        }
+    };
+
+    static remote_free_cache& thread_remote_free_cache()
+    {
+        static thread_local remote_free_cache c;
+        return c;
+    }
+
+    // blocks of pools which no longer exist are dropped
+    static void flush(remote_free_buffer& buffer)
+    {
+        if (buffer.blocks.empty()) return;
+        {
+            std::shared_lock<std::shared_mutex> lock(buffer.token->mutex);
+            if (buffer.token->p) buffer.token->p->free_batch(buffer.blocks);
+        }
+        buffer.blocks.clear();
+    }
 
   private:
+    static constexpr std::size_t s_num_bins = 8;
+    static constexpr std::size_t s_cache_line = 64;
+    static constexpr std::size_t s_min_colored_size = 2048;
+    static constexpr std::size_t s_max_bitmap_size = 128;
+
     static std::size_t num_pages(std::size_t segment_size) noexcept
     {
         auto x = (segment_size + numa().page_size() - 1) / numa().page_size();
         return x;
     }
 
-    static auto check_allocation(numa_tools::allocation const& a, std::size_t expected_numa_node)
+    auto check_allocation(numa_tools::allocation const& a)
     {
         if (!a) { throw std::runtime_error("could not allocate system memory"); }
-        else if (a.node != expected_numa_node)
+        else if (a.node != m_numa_node)
         {
-            numa().free(a);
-            throw std::runtime_error("could not allocate on requested numa node");
+            if (m_numa_fallback)
+            {
+                ++m_num_fallback_segments;
+                HWMALLOC_LOG("segment of pool on node", m_numa_node, "placed on node", a.node);
+                HWMALLOC_TRACE(fallback, m_block_size, a.node);
+            }
+            // only the libnuma path may silently end up on a different node
+            else if (m_placement == numa_tools::placement::onnode)
+            {
+                numa().free(a);
+                throw std::runtime_error("could not allocate on requested numa node");
+            }
         }
         return a;
     }
 
   private:
-    Context*    m_context;
-    std::size_t m_block_size;
-    std::size_t m_segment_size;
-    std::size_t m_numa_node;
-    bool        m_never_free;
-    std::size_t m_num_reserve_segments;
-    stack_type  m_free_stack;
-    segment_map m_segments;
-    std::mutex  m_mutex;
-    int         m_device_id = 0;
-    bool        m_allocate_on_device = false;
-
-    void add_segment()
-    {
-        auto a =
-            check_allocation(numa().allocate(num_pages(m_segment_size), m_numa_node), m_numa_node);
+    Context*                 m_context;
+    std::size_t              m_block_size;
+    std::size_t              m_segment_size;
+    std::size_t              m_numa_node;
+    bool                     m_never_free;
+    std::size_t              m_num_reserve_segments;
+    numa_tools::placement    m_placement;
+    std::vector<std::size_t> m_interleave_nodes;
+    bool                     m_numa_fallback;
+    std::atomic<std::size_t> m_num_fallback_segments = 0;
+    std::size_t              m_remote_free_batch;
+    segment_table_ptr        m_segment_table;
+    node_arena*              m_arena;
+    shard_vector             m_free_stacks;
+    active_vector            m_active; // bitmap engine
+    elimination_array        m_elimination;
+    segment_map              m_segments;
+    bin_vector               m_bins;
+    std::atomic<std::size_t> m_num_segments = 0; // without retired segments
+    std::mutex               m_mutex;
+    int                      m_device_id = 0;
+    bool                     m_allocate_on_device = false;
+    std::size_t              m_num_colors = 1;
+    std::size_t              m_color_step = 0;
+    std::size_t              m_next_color = 0;
+
+    std::shared_ptr<remote_free_token> m_remote_free_token;
+
+    // empty segments waiting to be destroyed, linked through the segments
+    std::atomic<segment_type*> m_retired{nullptr};
+
+    auto register_memory(void* ptr, std::size_t size)
+    {
+        HWMALLOC_TRACE(register_begin, ptr, size);
+        auto r = hwmalloc::register_memory(*m_context, ptr, size);
+        HWMALLOC_TRACE(register_end, ptr, size);
+        return r;
+    }
+
+#if HWMALLOC_ENABLE_DEVICE
+    auto register_device_memory(void* ptr, std::size_t size)
+    {
+        HWMALLOC_TRACE(register_begin, ptr, size);
+        auto r = hwmalloc::register_device_memory(*m_context, ptr, size);
+        HWMALLOC_TRACE(register_end, ptr, size);
+        return r;
+    }
+#endif
+
+    numa_tools::allocation allocate_segment_memory() const noexcept
+    {
+        const auto n = num_pages(m_segment_size + (m_num_colors - 1) * m_color_step);
+        if (m_placement == numa_tools::placement::interleave && !m_interleave_nodes.empty())
+            return numa().allocate_interleaved(n, m_interleave_nodes);
+        if (!m_numa_fallback || m_placement == numa_tools::placement::interleave)
+            return numa().allocate(n, m_numa_node, m_placement);
+        // try the nodes of the same tier with enough free memory in order of increasing distance
+        for (auto node : numa().nearest_nodes(m_numa_node))
+        {
+            if (numa().tier_of(node) != numa().tier_of(m_numa_node)) continue;
+            if (numa().free_memory(node) < n * numa().page_size()) continue;
+            auto a = numa().allocate(n, node,
+                node == m_numa_node ? m_placement : numa_tools::placement::bind);
+            if (a && a.node == node) return a;
+            numa().free(a);
+        }
+        return {};
+    }
+
+    // with check_capacity, nullptr is returned instead of throwing when the memory cannot be
+    // placed on the pool's node
+    segment_type* add_segment(free_list_type& free_stack, bool check_capacity = false)
+    {
+        segment_type* r;
+        const auto    m = allocate_segment_memory();
+        if (check_capacity && (!m || m.node != m_numa_node))
+        {
+            if (m) numa().free(m);
+            return nullptr;
+        }
+        auto       a = check_allocation(m);
+        const auto offset = (m_next_color++ % m_num_colors) * m_color_step;
 #if HWMALLOC_ENABLE_DEVICE
         if (m_allocate_on_device)
         {
@@ -70,92 +222,582 @@ class pool
             set_device_id(m_device_id);
             void* device_ptr = device_malloc(a.size);
 
-            auto s = std::make_unique<segment_type>(this,
-                hwmalloc::register_memory(*m_context, a.ptr, a.size), a,
-                hwmalloc::register_device_memory(*m_context, device_ptr, a.size), device_ptr,
-                m_device_id, m_block_size, m_free_stack);
-            m_segments[s.get()] = std::move(s);
+            auto s = make_node_ptr<segment_type>(*m_arena, this, register_memory(a.ptr, a.size), a,
+                register_device_memory(device_ptr, a.size), device_ptr, m_device_id, m_block_size,
+                free_stack, offset);
+            r = s.get();
+            m_segments[r] = std::move(s);
             set_device_id(tmp);
         }
         else
 #endif
         {
-            auto s = std::make_unique<segment_type>(this,
-                hwmalloc::register_memory(*m_context, a.ptr, a.size), a, m_block_size,
-                m_free_stack);
-            m_segments[s.get()] = std::move(s);
+            auto s = make_node_ptr<segment_type>(*m_arena, this, register_memory(a.ptr, a.size), a,
+                m_block_size, free_stack, offset);
+            r = s.get();
+            m_segments[r] = std::move(s);
+        }
+        ++m_num_segments;
+        HWMALLOC_TRACE(segment_add, a.ptr, a.size);
+        return r;
+    }
+
+    bool has_capacity() const noexcept
+    {
+        return numa().free_memory(m_numa_node) >=
+               num_pages(m_segment_size + (m_num_colors - 1) * m_color_step) * numa().page_size();
+    }
+
+    // shard of the calling thread's cache domain
+    std::size_t local_shard() const noexcept
+    {
+        if (m_free_stacks.size() == 1u) return 0u;
+        return numa().cache_domain() % m_free_stacks.size();
+    }
+
+    free_list_type& local_free_stack() const noexcept { return *m_free_stacks[local_shard()]; }
+
+    block_type make_block(id_type id) const noexcept
+    {
+        return m_segment_table->segment(id)->make_block(m_segment_table->index(id));
+    }
+
+    // prefetch a free block and its next-id, which the following pop reads
+    void prefetch(id_type id) const noexcept
+    {
+        if (id == segment_table_type::nil) return;
+        __builtin_prefetch(m_segment_table->origin(id) + m_segment_table->index(id) * m_block_size,
+            1);
+        __builtin_prefetch(&m_segment_table->next(id));
+    }
+
+    bool pop(block_type& b, free_list_type& free_list) const noexcept
+    {
+        id_type id;
+        if (!free_list.pop(id)) return false;
+        b = make_block(id);
+        prefetch(free_list.peek());
+        return true;
+    }
+
+    // take a block offered by a concurrent free
+    bool take_eliminated(block_type& b) noexcept
+    {
+        id_type id;
+        if (!m_elimination.enabled() || !m_elimination.take(id)) return false;
+        b = make_block(id);
+        return true;
+    }
+
+    // pop from the local shard and steal from the other shards when it is empty
+    bool steal(block_type& b, free_list_type& local) const noexcept
+    {
+        if (pop(b, local)) return true;
+        for (auto& s : m_free_stacks)
+            if (s.get() != &local && pop(b, *s)) return true;
+        return false;
+    }
+
+    // collect the freed blocks of the most occupied segments first, so that lightly used segments
+    // can drain and be released: segments are binned by their number of freed blocks (in eighths
+    // of their capacity) and collected bin by bin until a quarter segment's worth of blocks has
+    // been collected
+    // requires the mutex
+    void collect(free_list_type& free_list)
+    {
+        m_bins.clear();
+        for (auto& kvp : m_segments)
+        {
+            const auto n = kvp.first->num_freed();
+            if (n > 0u && !kvp.first->is_retired())
+                m_bins.emplace_back(n * s_num_bins / (kvp.first->capacity() + 1), kvp.first);
+        }
+        std::sort(m_bins.begin(), m_bins.end(),
+            [](auto const& a, auto const& b) { return a.first < b.first; });
+        std::size_t n = 0;
+        for (auto const& x : m_bins)
+        {
+            n += x.second->collect(free_list);
+            if (n * 4 >= x.second->capacity()) break;
+        }
+    }
+
+    // bitmap engine: take a block from the segment published for the given shard
+    bool take_bit(block_type& b, std::size_t shard) noexcept
+    {
+        // the segment may be retired and destroyed concurrently
+        epoch_guard g;
+        std::size_t i;
+        auto        s = m_active[shard].m_segment.load(std::memory_order_acquire);
+        if (!s || !s->take_free(i)) return false;
+        b = s->make_block(i);
+        // blocks are taken in address order
+        if (i + 1u < s->capacity()) __builtin_prefetch((char*)b.m_ptr + m_block_size, 1);
+        return true;
+    }
+
+    // bitmap engine: the segment with the fewest free blocks (but at least one), so that lightly
+    // used segments can drain and be released
+    // requires the mutex
+    segment_type* fullest_segment() const noexcept
+    {
+        segment_type* r = nullptr;
+        std::size_t   m = 0u;
+        for (auto& kvp : m_segments)
+        {
+            const auto n = kvp.first->num_freed();
+            if (n == 0u || kvp.first->is_retired() || (r && n >= m)) continue;
+            r = kvp.first;
+            m = n;
         }
+        return r;
+    }
+
+    // bitmap engine: remove a segment from the active slots
+    // returns true if it was published
+    bool unpublish(segment_type* s) noexcept
+    {
+        bool r = false;
+        for (auto& a : m_active)
+        {
+            auto x = s;
+            r = a.m_segment.compare_exchange_strong(x, nullptr) || r;
+        }
+        return r;
+    }
+
+    bool allocate_bitmap(block_type& b, bool check_capacity)
+    {
+        const auto shard = local_shard();
+        if (take_eliminated(b) || take_bit(b, shard)) return true;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (take_bit(b, shard)) return true;
+        HWMALLOC_TRACE(slow_path_begin, m_block_size, m_numa_node);
+        reclaim();
+        do
+        {
+            auto s = fullest_segment();
+            if (!s && (!check_capacity || has_capacity()))
+                s = add_segment(*m_free_stacks[0], check_capacity);
+            if (!s)
+            {
+                HWMALLOC_TRACE(budget, m_block_size, m_numa_node);
+                HWMALLOC_TRACE(slow_path_end, m_block_size, m_numa_node);
+                return false;
+            }
+            s->rescan();
+            m_active[shard].m_segment.store(s, std::memory_order_release);
+        } while (!take_bit(b, shard));
+        HWMALLOC_TRACE(slow_path_end, m_block_size, m_numa_node);
+        return true;
+    }
+
+    bool allocate(block_type& b, bool check_capacity)
+    {
+        if (!m_active.empty()) return allocate_bitmap(b, check_capacity);
+        auto& local = local_free_stack();
+        if (take_eliminated(b) || steal(b, local)) return true;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (steal(b, local)) return true;
+        HWMALLOC_TRACE(slow_path_begin, m_block_size, m_numa_node);
+        reclaim();
+        collect(local);
+        if (pop(b, local))
+        {
+            HWMALLOC_TRACE(slow_path_end, m_block_size, m_numa_node);
+            return true;
+        }
+        unsigned int counter = 0;
+        while (!pop(b, local))
+        {
+            // add segments every 2nd iteration
+            if (counter++ % 2 == 0)
+            {
+                // has_capacity is only a hint: the allocation of the segment may still fail
+                if ((check_capacity && !has_capacity()) || !add_segment(local, check_capacity))
+                {
+                    HWMALLOC_TRACE(budget, m_block_size, m_numa_node);
+                    HWMALLOC_TRACE(slow_path_end, m_block_size, m_numa_node);
+                    return false;
+                }
+            }
+        }
+        HWMALLOC_TRACE(slow_path_end, m_block_size, m_numa_node);
+        return true;
     }
 
   public:
+    // pools sharing a segment table can exchange segments (see migrate)
     pool(Context* context, std::size_t block_size, std::size_t segment_size, std::size_t numa_node,
-        bool never_free, std::size_t num_reserve_segments)
+        heap_config const& config, segment_table_ptr segment_table = {})
     : m_context{context}
     , m_block_size{block_size}
     , m_segment_size{segment_size}
     , m_numa_node{numa_node}
-    , m_never_free{never_free}
-    , m_num_reserve_segments{std::max(num_reserve_segments, 1ul)}
-    , m_free_stack(segment_size / block_size)
+    , m_never_free{config.never_free}
+    , m_num_reserve_segments{std::max(config.num_reserve_segments, 1ul)}
+    , m_placement{config.numa_placement}
+    , m_interleave_nodes{config.interleave_nodes}
+    , m_numa_fallback{config.numa_fallback}
+    , m_remote_free_batch{config.remote_free_batch}
+    , m_segment_table{segment_table ? std::move(segment_table)
+                                    : make_segment_table(block_size, segment_size, config)}
+    , m_arena{&m_segment_table->arena(numa_node)}
+    , m_free_stacks{node_allocator<node_ptr<free_list_type>>(*m_arena)}
+    , m_active(m_segment_table->linked() ? 0u : num_shards(numa_node, config),
+          node_allocator<active_segment>(*m_arena))
+    , m_elimination{config.elimination_slots, *m_arena, config.elimination_spin}
+    , m_segments{0u, std::hash<segment_type*>{}, std::equal_to<segment_type*>{},
+          node_allocator<std::pair<segment_type* const, segment_ptr>>(*m_arena)}
+    , m_bins{node_allocator<typename bin_vector::value_type>(*m_arena)}
+    {
+        for (std::size_t i = 0; i < num_shards(numa_node, config); ++i)
+            m_free_stacks.push_back(make_node_ptr<free_list_type>(*m_arena, *m_segment_table));
+        // segments of power-of-two blocks start at rotating multiples of the color step, which
+        // keeps the extra memory per segment below one block
+        const std::size_t step =
+            std::max<std::size_t>(s_cache_line, region_traits_type::required_alignment(*context));
+        if (config.cache_colors > 1u && block_size >= s_min_colored_size &&
+            (block_size & (block_size - 1)) == 0u && step < block_size)
+        {
+            m_num_colors = std::min(config.cache_colors, block_size / step);
+            m_color_step = step;
+        }
+        if (m_remote_free_batch > 1u)
+        {
+            m_remote_free_token = std::make_shared<remote_free_token>();
+            m_remote_free_token->p = this;
+        }
+        // interleaved segments are accounted to the pool's node
+        if (m_placement == numa_tools::placement::interleave && !m_interleave_nodes.empty())
+        {
+            auto it = std::find(m_interleave_nodes.begin(), m_interleave_nodes.end(), numa_node);
+            if (it != m_interleave_nodes.end()) std::iter_swap(m_interleave_nodes.begin(), it);
+            else
+                m_interleave_nodes.insert(m_interleave_nodes.begin(), numa_node);
+        }
+    }
+
+    pool(Context* context, std::size_t block_size, std::size_t segment_size, std::size_t numa_node,
+        bool never_free, std::size_t num_reserve_segments)
+    : pool(context, block_size, segment_size, numa_node,
+          heap_config{never_free, num_reserve_segments})
     {
     }
 
 #if HWMALLOC_ENABLE_DEVICE
     pool(Context* context, std::size_t block_size, std::size_t segment_size, std::size_t numa_node,
-        int device_id, bool never_free, std::size_t num_reserve_segments)
-    : pool(context, block_size, segment_size, numa_node, never_free, num_reserve_segments)
+        int device_id, heap_config const& config, segment_table_ptr segment_table = {})
+    : pool(context, block_size, segment_size, numa_node, config, std::move(segment_table))
     {
         m_device_id = device_id;
         m_allocate_on_device = true;
     }
+
+    pool(Context* context, std::size_t block_size, std::size_t segment_size, std::size_t numa_node,
+        int device_id, bool never_free, std::size_t num_reserve_segments)
+    : pool(context, block_size, segment_size, numa_node, device_id,
+          heap_config{never_free, num_reserve_segments})
+    {
+    }
 #endif
 
+    ~pool()
+    {
+        // invalidate the blocks still buffered by other threads
+        if (m_remote_free_token)
+        {
+            std::unique_lock<std::shared_mutex> lock(m_remote_free_token->mutex);
+            m_remote_free_token->p = nullptr;
+        }
+    }
+
+    // segment table for pools of the given geometry, without links if the pools use the bitmap
+    // engine
+    static segment_table_ptr make_segment_table(std::size_t block_size, std::size_t segment_size,
+        heap_config const& config = {})
+    {
+        return std::make_shared<segment_table_type>(
+            num_pages(segment_size) * numa().page_size() / block_size,
+            !(config.bitmap_tiny_classes && block_size <= s_max_bitmap_size));
+    }
+
+    static std::size_t num_shards(std::size_t numa_node, heap_config const& config)
+    {
+        return config.cache_domain_shards ? numa().num_cache_domains(numa_node) : 1u;
+    }
+
+    std::size_t numa_node() const noexcept { return m_numa_node; }
+
+    // number of segments which were placed on another node than numa_node()
+    std::size_t num_fallback_segments() const noexcept { return m_num_fallback_segments.load(); }
+
+    // number of segments, not counting retired ones
+    std::size_t num_segments() const noexcept { return m_num_segments.load(); }
+
+    // alignment of all blocks: the largest power of two dividing the block size, at most the page
+    // size (segments are page aligned) and at most the color step's if the pool is cache colored
+    std::size_t alignment() const noexcept
+    {
+        auto a = std::min(numa().page_size(), m_block_size & (~m_block_size + 1u));
+        if (m_num_colors > 1u) a = std::min(a, m_color_step & (~m_color_step + 1u));
+        return a;
+    }
+
     auto allocate()
     {
         block_type b;
-        if (m_free_stack.pop(b)) return b;
-        m_mutex.lock();
-        if (m_free_stack.pop(b))
+        allocate(b, false);
+        return b;
+    }
+
+    // allocate without adding segments when the pool's node is out of memory
+    // returns false if no block could be obtained
+    bool try_allocate(block_type& b) { return allocate(b, true); }
+
+    // move the segments of this pool to the pool `to' (on another numa node)
+    // the pages are migrated and the segments change ownership; blocks in use stay valid and are
+    // returned to `to' when freed. If the context requires re-registration, only segments without
+    // blocks in use are moved. Both pools must share their segment table. Returns the number of
+    // migrated segments.
+    std::size_t migrate(pool& to)
+    {
+        if (&to == this || to.m_numa_node == m_numa_node) return 0u;
+        if (to.m_segment_table != m_segment_table) return 0u;
+        std::scoped_lock lock(m_mutex, to.m_mutex);
+        const bool reregister = region_traits_type::requires_reregistration(*m_context);
+
+        // take all free blocks out of circulation
+        std::vector<id_type> blocks;
+        for (auto& kvp : m_segments) kvp.first->collect(*m_free_stacks[0]);
+        for (auto& stack : m_free_stacks)
+            for (id_type id; stack->pop(id);) blocks.push_back(id);
+        std::unordered_map<segment_type*, std::size_t> num_free;
+        for (auto id : blocks) ++num_free[m_segment_table->segment(id)];
+        // the bitmap engine's segments are published again by the slow path
+        for (auto& a : m_active) a.m_segment.store(nullptr);
+
+        std::size_t                       n = 0;
+        std::unordered_set<segment_type*> renewed;
+        for (auto it = m_segments.begin(); it != m_segments.end();)
         {
-            m_mutex.unlock();
-            return b;
+            auto s = it->first;
+            // concurrent frees may still trim the segment: the claim excludes retiring it (and
+            // allocating from it) until it has changed pools, retired segments are skipped
+            if (!s->claim())
+            {
+                ++it;
+                continue;
+            }
+            bool moved = false;
+            if (!reregister) moved = s->migrate(to.m_numa_node);
+            else if (!m_active.empty())
+            {
+                // bitmap engine: only segments without blocks in use
+                if (s->is_empty())
+                {
+                    s->reset_region();
+                    moved = s->migrate(to.m_numa_node);
+                    s->set_region(register_memory(s->get_ptr(), s->size()), *m_free_stacks[0]);
+                }
+            }
+            else if (num_free[s] == s->capacity())
+            {
+                // the blocks are pushed again by set_region
+                s->reset_region();
+                moved = s->migrate(to.m_numa_node);
+                s->set_region(register_memory(s->get_ptr(), s->size()),
+                    moved ? *to.m_free_stacks[0] : *m_free_stacks[0]);
+                renewed.insert(s);
+            }
+            if (!moved) ++it;
+            else
+            {
+                HWMALLOC_TRACE(migrate, s->get_ptr(), to.m_numa_node);
+                s->set_pool(&to);
+                to.m_segments[s] = std::move(it->second);
+                it = m_segments.erase(it);
+                --m_num_segments;
+                ++to.m_num_segments;
+                ++n;
+            }
+            s->unretire();
         }
-        for (auto& kvp : m_segments) kvp.first->collect(m_free_stack);
-        if (m_free_stack.pop(b))
+
+        // return the free blocks to the pools now owning their segments
+        for (auto id : blocks)
         {
-            m_mutex.unlock();
-            return b;
+            auto s = m_segment_table->segment(id);
+            if (renewed.count(s)) continue;
+            auto& stack = (s->get_pool() == this) ? *m_free_stacks[0] : *to.m_free_stacks[0];
+            stack.push(id, id);
         }
-        unsigned int counter = 0;
-        while (!m_free_stack.pop(b))
+        return n;
+    }
+
+    void free(block_type const& b)
+    {
+        if (m_remote_free_batch > 1u && b.m_segment->numa_node() != numa().local_node())
+            return free_remote(b);
+        pool* owner;
         {
-            // add segments every 2nd iteration
-            if (counter++ % 2 == 0) add_segment();
+            // the segment may be retired and destroyed by another thread as soon as the block is
+            // back in it
+            epoch_guard g;
+            auto        s = b.m_segment;
+            if (!m_elimination.enabled()) s->free(b);
+            else if (!s->try_free(b))
+            {
+                // the segment is contended: hand the block to an allocating thread if possible
+                if (m_elimination.offer(s->id_of(b))) return;
+                s->free(b);
+            }
+            trim(s);
+            // the segment may have been migrated since the block's release looked up its pool
+            owner = s->get_pool();
         }
-        m_mutex.unlock();
-        return b;
+        owner->try_reclaim();
     }
 
-    void free(block_type const& b)
+    // return the calling thread's buffered remote frees of all pools
+    static void flush_remote_frees()
     {
-        b.m_segment->free(b);
-        if (!m_never_free && b.m_segment->is_empty())
+        auto& buffers = thread_remote_free_cache().buffers;
+        for (auto it = buffers.begin(); it != buffers.end();)
         {
-            std::lock_guard<std::mutex> lock(m_mutex);
-            if (b.m_segment->is_empty() && m_segments.size() > m_num_reserve_segments)
+            flush(it->second);
+            // forget pools which no longer exist
+            std::shared_lock<std::shared_mutex> lock(it->second.token->mutex);
+            if (!it->second.token->p)
+            {
+                lock.unlock();
+                it = buffers.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+
+  private:
+    void free_remote(block_type const& b)
+    {
+        auto& buffer = thread_remote_free_cache().buffers[this];
+        // first use, or left over from a destroyed pool at the same address
+        if (buffer.token != m_remote_free_token)
+        {
+            if (buffer.token) flush(buffer);
+            buffer.token = m_remote_free_token;
+            buffer.blocks.reserve(m_remote_free_batch);
+        }
+        buffer.blocks.push_back(b);
+        if (buffer.blocks.size() >= m_remote_free_batch) flush(buffer);
+    }
+
+    // return blocks to their segments, one splice per segment
+    void free_batch(std::vector<block_type>& blocks)
+    {
+        std::sort(blocks.begin(), blocks.end(),
+            [](auto const& a, auto const& b) { return std::less<>{}(a.m_segment, b.m_segment); });
+        std::vector<pool*> pools;
+        {
+            epoch_guard g;
+            for (auto first = blocks.begin(); first != blocks.end();)
+            {
+                auto s = first->m_segment;
+                auto last = std::find_if(
+                    first, blocks.end(), [s](auto const& b) { return b.m_segment != s; });
+                s->free(first, last);
+                trim(s);
+                // the segment may have been migrated to another pool in the meantime
+                auto p = s->get_pool();
+                if (std::find(pools.begin(), pools.end(), p) == pools.end()) pools.push_back(p);
+                first = last;
+            }
+        }
+        for (auto p : pools) p->try_reclaim();
+    }
+
+    // retire a segment if it is empty and not needed as reserve by the pool owning it
+    // lock-free, must be called inside an epoch critical section
+    static void trim(segment_type* s)
+    {
+        // the segment may change pools concurrently (see migrate): once retired it cannot, so the
+        // owner is checked again after retiring and the segment is handed to the new owner
+        pool* p = s->get_pool();
+        while (true)
+        {
+            if (p->m_never_free || !s->is_empty()) return;
+            auto n = p->m_num_segments.load();
+            do
+            {
+                if (n <= p->m_num_reserve_segments) return;
+            } while (!p->m_num_segments.compare_exchange_weak(n, n - 1));
+            const bool retired = s->retire();
+            const auto owner = s->get_pool();
+            if (retired && owner == p) break;
+            ++p->m_num_segments;
+            if (!retired) return;
+            s->unretire();
+            p = owner;
+        }
+        p->unpublish(s);
+        s->m_retired_epoch = epoch_manager::instance().retire();
+        p->push_retired(s);
+    }
+
+    void push_retired(segment_type* s) noexcept
+    {
+        s->m_retired_next = m_retired.load(std::memory_order_relaxed);
+        while (!m_retired.compare_exchange_weak(s->m_retired_next, s, std::memory_order_release,
+            std::memory_order_relaxed)) {}
+    }
+
+    // destroy the retired segments if the mutex is free, never blocks
+    void try_reclaim()
+    {
+        if (!m_retired.load(std::memory_order_relaxed)) return;
+        std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+        if (lock) reclaim();
+    }
+
+    // destroy the retired segments which no thread can reach anymore
+    // requires the mutex
+    void reclaim()
+    {
+        for (auto s = m_retired.exchange(nullptr, std::memory_order_acquire); s;)
+        {
+            auto next = s->m_retired_next;
+            // only the owner can erase the segment (trim retires segments on their owner)
+            if (auto owner = s->get_pool(); owner != this)
+            {
+                owner->push_retired(s);
+                s = next;
+                continue;
+            }
+            // the slow path may have published the segment again before it was retired: it was
+            // reachable until now
+            if (unpublish(s))
+            {
+                s->m_retired_epoch = epoch_manager::instance().retire();
+                push_retired(s);
+            }
+            else if (!epoch_manager::instance().is_safe(s->m_retired_epoch)) push_retired(s);
+            else
             {
+                HWMALLOC_TRACE(trim, m_block_size, m_segments.size() - 1);
 #if HWMALLOC_ENABLE_DEVICE
                 if (m_allocate_on_device)
                 {
                     const auto tmp = get_device_id();
                     set_device_id(m_device_id);
-                    m_segments.erase(b.m_segment);
+                    m_segments.erase(s);
                     set_device_id(tmp);
                 }
                 else
 #endif
-                    m_segments.erase(b.m_segment);
+                    m_segments.erase(s);
             }
+            s = next;
         }
     }
 };
@@ -20,6 +20,36 @@ namespace hwmalloc
 {
 namespace detail
 {
+// optional customization point requires_reregistration(context), found by ADL
+template<typename Context>
+auto
+call_requires_reregistration(Context const& c, int) -> decltype(requires_reregistration(c))
+{
+    return requires_reregistration(c);
+}
+
+template<typename Context>
+bool
+call_requires_reregistration(Context const&, long)
+{
+    return false;
+}
+
+// optional customization point required_alignment(context), found by ADL
+template<typename Context>
+auto
+call_required_alignment(Context const& c, int) -> decltype(required_alignment(c))
+{
+    return required_alignment(c);
+}
+
+template<typename Context>
+std::size_t
+call_required_alignment(Context const&, long)
+{
+    return 1u;
+}
+
 template<typename Context>
 struct region_traits
 {
@@ -55,6 +85,18 @@ struct region_traits
     static_assert(
         std::is_copy_assignable<device_handle_type>::value, "device_handle is not copy assignable");
 #endif
+
+    // whether memory has to be registered again after its pages were moved to another node
+    static bool requires_reregistration(Context const& c)
+    {
+        return call_requires_reregistration(c, 0);
+    }
+
+    // alignment of block addresses the context needs
+    static std::size_t required_alignment(Context const& c)
+    {
+        return call_required_alignment(c, 0);
+    }
 };
 
 } // namespace detail
@@ -10,13 +10,20 @@
 #pragma once
 
 #include <hwmalloc/detail/block.hpp>
+#include <hwmalloc/detail/free_list.hpp>
+#include <hwmalloc/detail/page_map.hpp>
 #include <hwmalloc/numa.hpp>
+#include <hwmalloc/trace.hpp>
 #if HWMALLOC_ENABLE_DEVICE
 #include <hwmalloc/device.hpp>
 #endif
 #include <type_traits>
-#include <boost/lockfree/stack.hpp>
+#include <algorithm>
 #include <atomic>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
 
 namespace hwmalloc
 {
@@ -55,98 +62,398 @@ class segment
 #endif
 
   private:
-    using stack_type = boost::lockfree::stack<block, boost::lockfree::fixed_sized<true>>;
+    using table_type = segment_table<segment>;
 
-    pool_type*        m_pool;
-    std::size_t       m_block_size;
-    std::size_t       m_num_blocks;
-    allocation_holder m_allocation;
-    region_type       m_region;
+  public:
+    using free_list_type = free_list<segment>;
+    using id_type = typename table_type::id_type;
+
+  private:
+    std::atomic<pool_type*>    m_pool;
+    std::size_t                m_block_size;
+    std::size_t                m_num_blocks;
+    std::size_t                m_offset; // of the first block (cache coloring)
+    allocation_holder          m_allocation;
+    std::size_t                m_numa_node;
+    std::optional<region_type> m_region;
 #if HWMALLOC_ENABLE_DEVICE
     device_allocation_holder            m_device_allocation;
     std::unique_ptr<device_region_type> m_device_region;
+    int                                 m_device_id = 0;
 #endif
-    stack_type        m_freed_stack;
-    std::atomic<long> m_num_freed;
+    table_type*           m_table;
+    id_type               m_id; // id of the first block
+    std::atomic<id_type>* m_next; // nullptr: bitmap engine
+    // blocks freed since the last collect, linked by their indices: the first block's index (low
+    // word), the number of blocks and the retired flag (high word)
+    std::atomic<std::uint64_t> m_freed;
+    // bitmap engine: one bit per block, set while the block is free
+    std::atomic<std::uint64_t>* m_bitmap = nullptr;
+    std::size_t                 m_num_words = 0u;
+    std::atomic<std::size_t>    m_hint{0u}; // no free block in the words below
+    node_arena*                 m_bitmap_arena = nullptr;
+    // retired segments are linked into their pool's list until they can be destroyed
+    segment*      m_retired_next = nullptr;
+    std::uint64_t m_retired_epoch = 0u;
+
+    static constexpr std::uint64_t s_retired = std::uint64_t(1) << 63;
+
+    static std::uint64_t pack(id_type first, std::uint64_t n) noexcept { return (n << 32) | first; }
+    static id_type       first(std::uint64_t freed) noexcept { return (id_type)freed; }
+    static std::size_t   count(std::uint64_t freed) noexcept { return (freed & ~s_retired) >> 32; }
+    static std::uint64_t bit(id_type i) noexcept { return std::uint64_t(1) << (i % 64u); }
+
+    friend pool_type;
 
   public:
-    template<typename Stack>
     segment(pool_type* pool, region_type&& region, numa_tools::allocation alloc,
-        std::size_t block_size, Stack& free_stack)
+        std::size_t block_size, free_list_type& free_list, std::size_t offset = 0u)
     : m_pool{pool}
     , m_block_size{block_size}
-    , m_num_blocks{alloc.size / block_size}
+    , m_num_blocks{std::min((alloc.size - offset) / block_size, free_list.table().num_blocks())}
+    , m_offset{offset}
     , m_allocation{alloc}
+    , m_numa_node{alloc.node}
     , m_region{std::move(region)}
-    , m_freed_stack(m_num_blocks)
-    , m_num_freed(0)
+    , m_table{&free_list.table()}
+    , m_id{m_table->acquire(this, m_numa_node, (char*)alloc.ptr + offset)}
+    , m_next{m_table->next_array(m_id)}
+    , m_freed{pack(table_type::nil, 0u)}
     {
-        char* origin = (char*)m_allocation.m.ptr;
-        for (std::size_t i = m_num_blocks; i > 0; --i)
-        {
-            block b{this, nullptr, origin + (i - 1) * block_size,
-                m_region.get_handle((i - 1) * block_size, block_size)};
-            while (!free_stack.push(b)) {}
-        }
+        init(free_list);
     }
 
 #if HWMALLOC_ENABLE_DEVICE
-    template<typename Stack>
     segment(pool_type* pool, region_type&& region, numa_tools::allocation alloc,
         device_region_type&& device_region, void* device_ptr, int device_id, std::size_t block_size,
-        Stack& free_stack)
+        free_list_type& free_list, std::size_t offset = 0u)
     : m_pool{pool}
     , m_block_size{block_size}
-    , m_num_blocks{alloc.size / block_size}
+    , m_num_blocks{std::min((alloc.size - offset) / block_size, free_list.table().num_blocks())}
+    , m_offset{offset}
     , m_allocation{alloc}
+    , m_numa_node{alloc.node}
     , m_region{std::move(region)}
     , m_device_allocation{device_ptr}
     , m_device_region{new device_region_type(std::move(device_region))}
-    , m_freed_stack(m_num_blocks)
-    , m_num_freed(0)
+    , m_device_id{device_id}
+    , m_table{&free_list.table()}
+    , m_id{m_table->acquire(this, m_numa_node, (char*)alloc.ptr + offset)}
+    , m_next{m_table->next_array(m_id)}
+    , m_freed{pack(table_type::nil, 0u)}
     {
-        char* origin = (char*)m_allocation.m.ptr;
-        char* device_origin = (char*)m_device_allocation.m;
-        for (std::size_t i = m_num_blocks; i > 0; --i)
-        {
-            block b{this, nullptr, origin + (i - 1) * block_size,
-                m_region.get_handle((i - 1) * block_size, block_size),
-                device_origin + (i - 1) * block_size,
-                m_device_region->get_handle((i - 1) * block_size, block_size), device_id};
-            while (!free_stack.push(b)) {}
-        }
+        init(free_list);
     }
 #endif
 
     segment(segment const&) = delete;
     segment(segment&&) = delete;
 
+    ~segment()
+    {
+        page_map<segment>::instance().assign(get_ptr(), size(), nullptr);
+        if (m_bitmap)
+            node_allocator<std::atomic<std::uint64_t>>(*m_bitmap_arena)
+                .deallocate(m_bitmap, m_num_words);
+        m_table->release(m_id);
+        HWMALLOC_TRACE(segment_remove, m_allocation.m.ptr, m_allocation.m.size);
+    }
+
     std::size_t block_size() const noexcept { return m_block_size; }
     std::size_t capacity() const noexcept { return m_num_blocks; }
-    std::size_t numa_node() const noexcept { return m_allocation.m.node; }
-    pool_type*  get_pool() const noexcept { return m_pool; }
+    std::size_t numa_node() const noexcept { return m_numa_node; }
+    pool_type*  get_pool() const noexcept { return m_pool.load(std::memory_order_acquire); }
+    void*       get_ptr() const noexcept { return m_allocation.m.ptr; }
+    std::size_t size() const noexcept { return m_allocation.m.size; }
+
+    // hand the segment over to another pool
+    // blocks in use are returned to the new pool when they are freed
+    void set_pool(pool_type* pool) noexcept { m_pool.store(pool, std::memory_order_release); }
+
+    // move the segment's pages to another numa node
+    bool migrate(std::size_t numa_node) noexcept
+    {
+        if (!numa().migrate(m_allocation.m, numa_node)) return false;
+        m_numa_node = numa_node;
+        return true;
+    }
+
+    // deregister the memory
+    // only valid when all blocks are free, their handles become invalid
+    void reset_region() noexcept { m_region.reset(); }
+
+    // register the memory again and push all blocks onto the free list
+    void set_region(region_type&& region, free_list_type& free_list)
+    {
+        m_region.emplace(std::move(region));
+        push_blocks(free_list);
+    }
+
+    // block with index i (in address order)
+    block make_block(std::size_t i) noexcept
+    {
+        char* const       origin = (char*)m_allocation.m.ptr;
+        const std::size_t offset = m_offset + i * m_block_size;
+#if HWMALLOC_ENABLE_DEVICE
+        if (char* const device_origin = (char*)m_device_allocation.m)
+            return block{this, nullptr, origin + offset,
+                m_region->get_handle(offset, m_block_size), device_origin + offset,
+                m_device_region->get_handle(offset, m_block_size), m_device_id};
+#endif
+        return block{this, nullptr, origin + offset, m_region->get_handle(offset, m_block_size)};
+    }
 
-    bool is_empty() const noexcept
+    // the part [offset, offset + size) of block b with its own handles
+    // the returned block is not owned by the segment: releasing it has no effect
+    block sub_block(block const& b, std::size_t offset, std::size_t size) const noexcept
     {
-        return static_cast<std::size_t>(m_num_freed.load()) == m_num_blocks;
+        const std::size_t o = (char*)b.m_ptr - (char*)m_allocation.m.ptr + offset;
+        block             r{b.m_segment, nullptr, (char*)b.m_ptr + offset,
+            m_region->get_handle(o, size)};
+#if HWMALLOC_ENABLE_DEVICE
+        if (b.m_device_ptr)
+        {
+            r.m_device_ptr = (char*)b.m_device_ptr + offset;
+            r.m_device_handle = m_device_region->get_handle(o, size);
+            r.m_device_id = m_device_id;
+        }
+#endif
+        r.m_owning = false;
+        return r;
+    }
+
+    // block starting at ptr, a null block if there is none
+    block block_at(void const* ptr) noexcept
+    {
+        const std::size_t d = (char const*)ptr - (char*)m_allocation.m.ptr;
+        if (d < m_offset || (d - m_offset) % m_block_size != 0u) return {};
+        const auto i = (d - m_offset) / m_block_size;
+        if (i >= m_num_blocks) return {};
+        return make_block(i);
+    }
+
+    // segment holding ptr, nullptr if ptr is not in a segment with this Context
+    static segment* find(void const* ptr) noexcept
+    {
+        return page_map<segment>::instance().find(ptr);
+    }
+
+    bool is_empty() const noexcept { return num_freed() == m_num_blocks; }
+
+    // number of blocks freed since the last collect (bitmap engine: number of free blocks)
+    std::size_t num_freed() const noexcept
+    {
+        if (!m_bitmap) return count(m_freed.load());
+        std::size_t n = 0u;
+        for (std::size_t w = 0; w < m_num_words; ++w) n += __builtin_popcountll(m_bitmap[w].load());
+        return n;
+    }
+
+    bool is_retired() const noexcept { return m_freed.load() & s_retired; }
+
+    // mark an empty segment as retired: its blocks are not collected anymore
+    bool retire() noexcept
+    {
+        if (m_bitmap)
+        {
+            // blocks may be taken concurrently: set the flag first and check for emptiness after,
+            // take_free gives blocks back when it sees the flag
+            if (m_freed.fetch_or(s_retired) & s_retired) return false;
+            if (is_empty()) return true;
+            unretire();
+            return false;
+        }
+        auto freed = m_freed.load();
+        return count(freed) == m_num_blocks && !(freed & s_retired) &&
+               m_freed.compare_exchange_strong(freed, freed | s_retired);
     }
 
-    template<typename Stack>
-    std::size_t collect(Stack& stack)
+    // set the retired flag of a segment which may have blocks in use, so that it is neither
+    // retired nor collected nor allocated from while it changes pools; fails if the flag is set
+    // already
+    bool claim() noexcept
     {
-        const auto consumed = m_freed_stack.consume_all(
-            [&stack](block const& b)
+        auto freed = m_freed.load();
+        do
+        {
+            if (freed & s_retired) return false;
+        } while (!m_freed.compare_exchange_weak(freed, freed | s_retired));
+        return true;
+    }
+
+    // clear the retired flag (bitmap engine, claimed segments)
+    void unretire() noexcept { m_freed.fetch_and(~s_retired); }
+
+    // take the free block with the lowest address (bitmap engine)
+    // fails if there is none or if the segment is retired
+    bool take_free(std::size_t& i) noexcept
+    {
+        const auto hint = m_hint.load(std::memory_order_relaxed);
+        for (auto w = hint; w < m_num_words; ++w)
+        {
+            for (auto bits = m_bitmap[w].load(std::memory_order_relaxed); bits;)
             {
-                while (!stack.push(b)) {}
-            });
-        m_num_freed.fetch_sub(consumed);
-        return consumed;
+                const auto b = bits & (~bits + 1u);
+                bits = m_bitmap[w].fetch_and(~b);
+                // taken by another thread
+                if (!(bits & b)) continue;
+                if (is_retired())
+                {
+                    m_bitmap[w].fetch_or(b);
+                    return false;
+                }
+                if (w != hint)
+                {
+                    auto h = hint;
+                    m_hint.compare_exchange_strong(h, w, std::memory_order_relaxed);
+                }
+                i = w * 64u + __builtin_ctzll(b);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // scan the whole bitmap again: a lagging hint may hide freed blocks (bitmap engine)
+    void rescan() noexcept { m_hint.store(0u, std::memory_order_relaxed); }
+
+    // move the freed blocks to a free list
+    std::size_t collect(free_list_type& free_list)
+    {
+        auto freed = m_freed.load(std::memory_order_relaxed);
+        do
+        {
+            if (count(freed) == 0u || (freed & s_retired)) return 0u;
+        } while (!m_freed.compare_exchange_weak(freed, pack(table_type::nil, 0u),
+            std::memory_order_acquire, std::memory_order_relaxed));
+        const auto n = count(freed);
+        // relink the chain with ids instead of indices
+        id_type i = first(freed);
+        for (std::size_t k = 1; k < n; ++k)
+        {
+            const auto j = m_next[i].load(std::memory_order_relaxed);
+            m_next[i].store(m_id + j, std::memory_order_relaxed);
+            i = j;
+        }
+        free_list.push(m_id + first(freed), m_id + i);
+        return n;
+    }
+
+    void free(block const& b) noexcept
+    {
+        const auto i = index_of(b);
+        if (m_bitmap) return free_bit(i);
+        push_freed(i, i, 1u);
+    }
+
+    // free with a single attempt, returns false if the freed list is contended
+    bool try_free(block const& b) noexcept
+    {
+        const auto i = index_of(b);
+        if (m_bitmap)
+        {
+            free_bit(i);
+            return true;
+        }
+        auto       freed = m_freed.load(std::memory_order_relaxed);
+        m_next[i].store(first(freed), std::memory_order_relaxed);
+        return m_freed.compare_exchange_strong(freed,
+            pack(i, count(freed) + 1u) | (freed & s_retired), std::memory_order_release,
+            std::memory_order_relaxed);
     }
 
-    void free(block const& b)
+    id_type id_of(block const& b) const noexcept { return m_id + index_of(b); }
+
+    // free a range of blocks: the blocks are linked to each other first and then spliced into the
+    // freed list with a single atomic operation
+    template<typename Iterator>
+    void free(Iterator first, Iterator last) noexcept
     {
-        while (!m_freed_stack.push(b)) {}
-        ++m_num_freed;
+        if (first == last) return;
+        if (m_bitmap)
+        {
+            for (; first != last; ++first) free_bit(index_of(*first));
+            return;
+        }
+        const auto  head = index_of(*first);
+        auto        tail = head;
+        std::size_t n = 1;
+        for (++first; first != last; ++first, ++n)
+        {
+            const auto i = index_of(*first);
+            m_next[tail].store(i, std::memory_order_relaxed);
+            tail = i;
+        }
+        push_freed(head, tail, n);
+    }
+
+  private:
+    id_type index_of(block const& b) const noexcept
+    {
+        return (id_type)(((char*)b.m_ptr - (char*)m_allocation.m.ptr - m_offset) / m_block_size);
+    }
+
+    // keeps the retired flag of claimed segments
+    void push_freed(id_type head, id_type tail, std::size_t n) noexcept
+    {
+        auto freed = m_freed.load(std::memory_order_relaxed);
+        do
+        {
+            m_next[tail].store(first(freed), std::memory_order_relaxed);
+        } while (!m_freed.compare_exchange_weak(freed,
+            pack(head, count(freed) + n) | (freed & s_retired), std::memory_order_release,
+            std::memory_order_relaxed));
+    }
+
+    void free_bit(id_type i) noexcept
+    {
+        const std::size_t w = i / 64u;
+        m_bitmap[w].fetch_or(bit(i), std::memory_order_release);
+        auto h = m_hint.load(std::memory_order_relaxed);
+        while (w < h && !m_hint.compare_exchange_weak(h, w, std::memory_order_relaxed)) {}
+    }
+
+    // all blocks free
+    // second part of the constructors: the destructor does not run if it throws, so the table slot
+    // and the pages mapped so far are given back here
+    void init(free_list_type& free_list)
+    {
+        try
+        {
+            // registered before the blocks are published, so that they can be looked up at once
+            page_map<segment>::instance().assign(get_ptr(), size(), this);
+            if (!m_next) init_bitmap();
+        }
+        catch (...)
+        {
+            page_map<segment>::instance().assign(get_ptr(), size(), nullptr);
+            m_table->release(m_id);
+            throw;
+        }
+        push_blocks(free_list);
+    }
+
+    void init_bitmap()
+    {
+        m_num_words = (m_num_blocks + 63u) / 64u;
+        m_bitmap_arena = &m_table->arena(m_numa_node);
+        m_bitmap =
+            node_allocator<std::atomic<std::uint64_t>>(*m_bitmap_arena).allocate(m_num_words);
+        for (std::size_t w = 0; w < m_num_words; ++w)
+        {
+            const auto n = std::min<std::size_t>(m_num_blocks - w * 64u, 64u);
+            new (m_bitmap + w) std::atomic<std::uint64_t>(
+                n == 64u ? ~std::uint64_t(0) : (std::uint64_t(1) << n) - 1u);
+        }
+    }
+
+    // push all blocks, lowest address on top (the bitmap engine has no free lists)
+    void push_blocks(free_list_type& free_list) noexcept
+    {
+        if (m_bitmap) return;
+        for (std::size_t i = 0; i + 1 < m_num_blocks; ++i)
+            m_next[i].store(m_id + (id_type)i + 1, std::memory_order_relaxed);
+        free_list.push(m_id, m_id + (id_type)m_num_blocks - 1);
     }
 };
 
@@ -157,5 +464,12 @@ void block_t<Context>::release_from_segment() const noexcept
     m_segment->get_pool()->free(*this);
 }
 
+template<typename Context>
+block_t<Context>
+block_t<Context>::sub_block_of_segment(std::size_t offset, std::size_t size) const noexcept
+{
+    return m_segment->sub_block(*this, offset, size);
+}
+
 } // namespace detail
 } // namespace hwmalloc
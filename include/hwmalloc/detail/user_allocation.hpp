@@ -98,5 +98,24 @@ block_t<Context>::release_user_allocation() const noexcept
     delete m_user_allocation;
 }
 
+template<typename Context>
+block_t<Context>
+block_t<Context>::sub_block_of_user_allocation(std::size_t offset, std::size_t size) const noexcept
+{
+    auto const&       a = *m_user_allocation;
+    const std::size_t o = (char*)m_ptr - (char*)a.m_host_allocation.m_ptr + offset;
+    block_t r{nullptr, m_user_allocation, (char*)m_ptr + offset, a.m_region.get_handle(o, size)};
+#if HWMALLOC_ENABLE_DEVICE
+    if (m_device_ptr)
+    {
+        r.m_device_ptr = (char*)m_device_ptr + offset;
+        r.m_device_handle = a.m_device_region->get_handle(o, size);
+        r.m_device_id = m_device_id;
+    }
+#endif
+    r.m_owning = false;
+    return r;
+}
+
 } // namespace detail
 } // namespace hwmalloc
@@ -0,0 +1,110 @@
+/*
+ * ghex-org
+ *
+ * Copyright (c) 2014-2023, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <hwmalloc/fancy_ptr/ptr.hpp>
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+
+namespace hwmalloc
+{
+// Contiguous view of count elements starting at a hw_ptr. Iteration uses raw pointers (unlike
+// hw_ptr, whose increments carry the whole block along), and subspans provide handles for exactly
+// their part of the block, so that partial ranges can be sent without copying.
+template<typename T, typename Block>
+class hw_span
+{
+  public:
+    using element_type = T;
+    using value_type = std::remove_cv_t<T>;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T*;
+    using reference = T&;
+    using iterator = T*;
+    using handle_type = typename Block::handle_type;
+#if HWMALLOC_ENABLE_DEVICE
+    using device_handle_type = typename Block::device_handle_type;
+#endif
+
+    static constexpr size_type npos = std::numeric_limits<size_type>::max();
+
+  private:
+    template<typename U, typename B>
+    friend class hw_span;
+
+    Block     m_block; // holding the elements
+    pointer   m_data = nullptr;
+    size_type m_size = 0u;
+
+  public:
+    constexpr hw_span() noexcept = default;
+
+    hw_span(hw_ptr<T, Block> const& ptr, size_type count) noexcept
+    : m_block{static_cast<hw_void_ptr<Block>>(ptr).m_data}
+    , m_data{ptr.get()}
+    , m_size{count}
+    {
+    }
+
+    template<typename U, std::enable_if_t<std::is_convertible_v<U (*)[], T (*)[]>, bool> = true>
+    hw_span(hw_span<U, Block> const& other) noexcept
+    : m_block{other.m_block}
+    , m_data{other.m_data}
+    , m_size{other.m_size}
+    {
+    }
+
+    pointer   data() const noexcept { return m_data; }
+    size_type size() const noexcept { return m_size; }
+    size_type size_bytes() const noexcept { return m_size * sizeof(T); }
+    bool      empty() const noexcept { return m_size == 0u; }
+    iterator  begin() const noexcept { return m_data; }
+    iterator  end() const noexcept { return m_data + m_size; }
+    reference front() const noexcept { return m_data[0]; }
+    reference back() const noexcept { return m_data[m_size - 1]; }
+    reference operator[](size_type i) const noexcept { return m_data[i]; }
+
+    hw_span first(size_type count) const noexcept { return subspan(0u, count); }
+    hw_span last(size_type count) const noexcept { return subspan(m_size - count, count); }
+
+    // the elements [offset, offset + count) (npos: up to the end)
+    hw_span subspan(size_type offset, size_type count = npos) const noexcept
+    {
+        hw_span s = *this;
+        s.m_data = m_data + offset;
+        s.m_size = (count == npos) ? m_size - offset : count;
+        return s;
+    }
+
+    // handle for the memory of the elements
+    handle_type handle() const noexcept { return part().m_handle; }
+
+#if HWMALLOC_ENABLE_DEVICE
+    bool    on_device() const noexcept { return m_block.on_device(); }
+    pointer device_data() const noexcept
+    {
+        return m_block.m_device_ptr ? (pointer)((char*)m_block.m_device_ptr + offset()) : nullptr;
+    }
+    device_handle_type device_handle() const noexcept { return part().m_device_handle; }
+#endif
+
+  private:
+    // of the first element within the block, in bytes
+    std::size_t offset() const noexcept
+    {
+        return (char const*)m_data - (char const*)m_block.m_ptr;
+    }
+
+    Block part() const noexcept { return m_block.sub_block(offset(), size_bytes()); }
+};
+
+} // namespace hwmalloc
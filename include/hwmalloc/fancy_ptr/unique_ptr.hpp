@@ -14,13 +14,25 @@
 
 namespace hwmalloc
 {
+// takes objects back instead of destroying them (see object_pool)
+template<typename T, typename Block>
+struct object_recycler
+{
+    virtual void recycle(hw_ptr<T, Block> const& ptr) noexcept = 0;
+
+  protected:
+    ~object_recycler() = default;
+};
+
 // scalar version
 template<typename T, typename Block>
 struct heap_delete
 {
     using pointer = hw_ptr<T, Block>;
-    void operator()(pointer ptr) const noexcept
+    object_recycler<T, Block>* recycler = nullptr;
+    void                       operator()(pointer ptr) const noexcept
     {
+        if (recycler) return recycler->recycle(ptr);
         ptr->~T();
         ptr.release();
     }
@@ -19,6 +19,8 @@ template<typename Context>
 class heap;
 template<typename T, typename Block>
 class hw_ptr;
+template<typename T, typename Block>
+class hw_span;
 
 template<typename Block, typename VoidPtr = void*>
 class hw_void_ptr
@@ -30,6 +32,8 @@ class hw_void_ptr
     friend class hw_void_ptr<Block, void const*>;
     template<typename T, typename B>
     friend class hw_ptr;
+    template<typename T, typename B>
+    friend class hw_span;
 
   public:
     using handle_type = typename Block::handle_type;
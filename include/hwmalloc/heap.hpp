@@ -11,10 +11,20 @@
 
 #include <hwmalloc/detail/user_allocation.hpp>
 #include <hwmalloc/detail/fixed_size_heap.hpp>
+#include <hwmalloc/heap_config.hpp>
 #include <hwmalloc/fancy_ptr/void_ptr.hpp>
 #include <hwmalloc/fancy_ptr/const_void_ptr.hpp>
 #include <hwmalloc/fancy_ptr/unique_ptr.hpp>
+#include <hwmalloc/fancy_ptr/span.hpp>
 #include <hwmalloc/allocator.hpp>
+#include <hwmalloc/object_pool.hpp>
+#include <hwmalloc/arena.hpp>
+#include <hwmalloc/memory_resource.hpp>
+#include <hwmalloc/local_allocator.hpp>
+#include <array>
+#include <cstring>
+#include <new>
+#include <stdexcept>
 #include <vector>
 #include <unordered_map>
 
@@ -44,6 +54,7 @@ class heap
     using device_region_type = typename detail::region_traits<Context>::device_region_type;
 #endif
     using fixed_size_heap_type = detail::fixed_size_heap<Context>;
+    using pool_type = typename fixed_size_heap_type::pool_type;
     using block_type = typename fixed_size_heap_type::block_type;
     using heap_vector = std::vector<std::unique_ptr<fixed_size_heap_type>>;
     using heap_map = std::unordered_map<std::size_t, std::unique_ptr<fixed_size_heap_type>>;
@@ -52,9 +63,19 @@ class heap
     template<typename T>
     using allocator_type = allocator<T, this_type>;
     template<typename T>
+    using local_allocator_type = local_allocator<T, this_type>;
+    using registry = heap_registry<this_type>;
+    template<typename T>
     using typed_pointer = typename allocator_type<T>::pointer;
     template<typename T>
     using unique_ptr = unique_ptr<T, block_type>;
+    template<typename T>
+    using span = hw_span<T, block_type>;
+    template<typename T>
+    using object_pool = object_pool<T, this_type>;
+    using arena = hwmalloc::arena<this_type>;
+    using memory_resource = hwmalloc::memory_resource<this_type>;
+    using monotonic_memory_resource = hwmalloc::monotonic_memory_resource<this_type>;
 
     // There are 5 size classes that the heap uses. For each size class it relies on a
     // fixed_size_heap. The size classes are:
@@ -96,6 +117,12 @@ class heap
     //  -------------------------------------------------------- Huge
     //    stored in map                                                   -+
     //    :                                                                :  m_huge_heaps: map
+    //
+    // Blocks are aligned to the largest power of two dividing their size, up to the page size.
+    // Aligned allocations round the size up to a multiple of the alignment, which selects a size
+    // class with aligned blocks. Cache colored classes (see heap_config::cache_colors) only
+    // guarantee the color step's alignment: larger alignments are served by uncolored heaps with
+    // the same block sizes, created on demand and stored in m_aligned_heaps.
 
   private:
     static constexpr std::size_t log2_c(std::size_t n) noexcept
@@ -106,6 +133,7 @@ class heap
     static const std::size_t s_tiny_limit = (1u << 7);   //   128
     static const std::size_t s_small_limit = (1u << 10); //  1024
     static const std::size_t s_large_limit = (1u << 16); // 65536
+    static const std::size_t s_max_size = (1u << 17);    // 131072: largest size class
 
     static const std::size_t s_bucket_shift = log2_c(s_tiny_limit) - 1;
 
@@ -130,46 +158,187 @@ class heap
         return log2_c((n - 1) >> s_bucket_shift) - 1;
     }
 
+    // size class of sizes up to m_max_size: the tiny heaps followed by m_heaps
+    // branch-free equivalent of tiny_bucket_index and bucket_index (size 0 maps to class 0)
+    static constexpr std::size_t size_class(std::size_t n) noexcept
+    {
+        const std::size_t tiny = ((n + s_tiny_increment - 1) >> s_tiny_increment_shift) - (n != 0u);
+        const std::size_t x = ((n - 1) >> s_bucket_shift) | 1u;
+        const std::size_t other = s_num_tiny_heaps + 63u - __builtin_clzll(x);
+        return n <= s_tiny_limit ? tiny : other;
+    }
+
     static constexpr std::size_t round_to_pow_of_2(std::size_t n) noexcept
     {
         return 1u << log2_c(n - 1);
     }
 
+    static constexpr std::size_t s_pools_per_line = 64 / sizeof(pool_type*);
+
+    // pools of consecutive slots, one cache line
+    struct alignas(64) pool_line
+    {
+        std::array<pool_type*, s_pools_per_line> m_pools = {};
+    };
+
   private:
-    Context*    m_context;
-    std::size_t m_max_size;
-    bool        m_never_free;
-    std::size_t m_num_reserve_segments;
-    heap_vector m_tiny_heaps;
-    heap_vector m_heaps;
-    heap_map    m_huge_heaps;
-    std::mutex  m_mutex;
+    Context*           m_context;
+    std::size_t        m_max_size;
+    heap_config        m_config;
+    heap_vector        m_tiny_heaps;
+    heap_vector        m_heaps;
+    heap_map           m_huge_heaps;
+    heap_map           m_aligned_heaps;
+    mutable std::mutex m_mutex;
+    // pools of all size classes up to m_max_size, indexed by [class][local node][target] where
+    // target 0 is the host and target d + 1 is device d; each class starts on a cache line
+    std::vector<pool_line>   m_pool_table;
+    std::size_t              m_num_nodes = 0;
+    std::size_t              m_num_targets = 1;
+    std::size_t              m_lines_per_class = 1;
+    std::vector<std::size_t> m_node_index; // numa node -> local node index (m_num_nodes: none)
+
+    pool_type*& pool_slot(std::size_t c, std::size_t node_index, std::size_t target) noexcept
+    {
+        const auto k = node_index * m_num_targets + target;
+        return m_pool_table[c * m_lines_per_class + k / s_pools_per_line]
+            .m_pools[k % s_pools_per_line];
+    }
+
+    // local node index of numa_node, or of the calling thread's node if numa_node is not local
+    std::size_t node_index(std::size_t numa_node) const noexcept
+    {
+        const auto i = numa_node < m_node_index.size() ? m_node_index[numa_node] : m_num_nodes;
+        return i < m_num_nodes ? i : numa().local_node_index();
+    }
+
+    // pool for sizes up to m_max_size
+    pool_type& get_pool(std::size_t size, std::size_t numa_node, std::size_t target = 0u) noexcept
+    {
+        return *pool_slot(size_class(size), node_index(numa_node), target);
+    }
+
+    // allocate on the numa node, memory tier and device of block b
+    pointer allocate_like(block_type const& b, std::size_t size)
+    {
+        const auto node = b.m_segment->get_pool()->numa_node();
+#if HWMALLOC_ENABLE_DEVICE
+        if (b.on_device()) return allocate(size, node, b.m_device_id);
+#endif
+        // tier nodes have no cpus: the tier is looked up from the nearest local node, so that the
+        // block stays on its node (or next to it) instead of moving next to the calling thread
+        const auto tier = numa().tier_of(node);
+        if (tier != numa_tools::memory_tier::dram)
+            return allocate(size, nearest_local_node(node), tier);
+        return allocate(size, node);
+    }
+
+    static std::size_t nearest_local_node(std::size_t node)
+    {
+        for (auto n : numa().nearest_nodes(node))
+            if (numa().local_nodes().find(n) != numa().local_nodes().end()) return n;
+        return numa().local_node();
+    }
+
+    void init_pool_table()
+    {
+        m_num_nodes = numa().local_nodes().size();
+#if HWMALLOC_ENABLE_DEVICE
+        const auto num_devices = get_num_devices();
+        m_num_targets = 1u + num_devices;
+#endif
+        m_lines_per_class = (m_num_nodes * m_num_targets + s_pools_per_line - 1) / s_pools_per_line;
+        const auto num_classes = m_tiny_heaps.size() + m_heaps.size();
+        m_pool_table.resize(num_classes * m_lines_per_class);
+        for (std::size_t c = 0; c < num_classes; ++c)
+        {
+            auto& h =
+                c < m_tiny_heaps.size() ? *m_tiny_heaps[c] : *m_heaps[c - m_tiny_heaps.size()];
+            for (auto [n, i] : numa().local_nodes())
+            {
+                pool_slot(c, i, 0u) = h.get_pool(i);
+#if HWMALLOC_ENABLE_DEVICE
+                for (int d = 0; d < num_devices; ++d)
+                    pool_slot(c, i, d + 1u) = h.get_device_pool(i, d);
+#endif
+                if (n >= m_node_index.size()) m_node_index.resize(n + 1, m_num_nodes);
+                m_node_index[n] = i;
+            }
+        }
+    }
+
+    fixed_size_heap_type& get_heap(std::size_t size)
+    {
+        if (size <= s_tiny_limit) return *m_tiny_heaps[tiny_bucket_index(size)];
+        else if (size <= m_max_size)
+            return *m_heaps[bucket_index(size)];
+        else
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            const auto                  s = round_to_pow_of_2(size);
+            auto&                       u_ptr = m_huge_heaps[s];
+            if (!u_ptr)
+                u_ptr = std::make_unique<fixed_size_heap_type>(m_context, s, s, m_config);
+            return *u_ptr;
+        }
+    }
+
+    // uncolored heap for blocks of the given size
+    fixed_size_heap_type& get_aligned_heap(std::size_t size)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto                  s = round_to_pow_of_2(size);
+        auto&                       u_ptr = m_aligned_heaps[s];
+        if (!u_ptr)
+        {
+            auto config = m_config;
+            config.cache_colors = 0;
+            u_ptr = std::make_unique<fixed_size_heap_type>(m_context, s,
+                std::max(s, s_large_segment), config);
+        }
+        return *u_ptr;
+    }
+
+    // a power of two up to the page size
+    static std::size_t check_alignment(std::align_val_t alignment)
+    {
+        const auto a = static_cast<std::size_t>(alignment);
+        if (a == 0u || (a & (a - 1u)) || a > numa().page_size())
+            throw std::invalid_argument("alignment must be a power of two up to the page size");
+        return a;
+    }
 
   public:
-    heap(Context* context, bool never_free = false, std::size_t num_reserve_segments = 1)
+    heap(Context* context, heap_config const& config)
     : m_context{context}
-    , m_max_size(std::max(round_to_pow_of_2(s_large_limit * 2), s_large_limit))
-    , m_never_free{never_free}
-    , m_num_reserve_segments{num_reserve_segments}
+    , m_max_size(s_max_size)
+    , m_config{config}
     , m_tiny_heaps(s_tiny_limit / s_tiny_increment)
     , m_heaps(bucket_index(m_max_size) + 1)
     {
         for (std::size_t i = 0; i < m_tiny_heaps.size(); ++i)
             m_tiny_heaps[i] = std::make_unique<fixed_size_heap_type>(m_context,
-                s_tiny_increment * (i + 1), s_tiny_segment, m_never_free, m_num_reserve_segments);
+                s_tiny_increment * (i + 1), s_tiny_segment, m_config);
 
         for (std::size_t i = 0; i < s_num_small_heaps; ++i)
             m_heaps[i] = std::make_unique<fixed_size_heap_type>(m_context,
-                (s_tiny_limit << (i + 1)), s_small_segment, m_never_free, m_num_reserve_segments);
+                (s_tiny_limit << (i + 1)), s_small_segment, m_config);
 
         for (std::size_t i = 0; i < s_num_large_heaps; ++i)
             m_heaps[i + s_num_small_heaps] = std::make_unique<fixed_size_heap_type>(m_context,
-                (s_small_limit << (i + 1)), s_large_segment, m_never_free, m_num_reserve_segments);
+                (s_small_limit << (i + 1)), s_large_segment, m_config);
 
         for (std::size_t i = 0; i < m_heaps.size() - (s_num_small_heaps + s_num_large_heaps); ++i)
             m_heaps[i + s_num_small_heaps + s_num_large_heaps] =
                 std::make_unique<fixed_size_heap_type>(m_context, (s_large_limit << (i + 1)),
-                    (s_large_limit << (i + 1)), m_never_free, m_num_reserve_segments);
+                    (s_large_limit << (i + 1)), m_config);
+
+        init_pool_table();
+    }
+
+    heap(Context* context, bool never_free = false, std::size_t num_reserve_segments = 1)
+    : heap(context, heap_config{never_free, num_reserve_segments})
+    {
     }
 
     heap(heap const&) = delete;
@@ -194,26 +363,69 @@ class heap
 
     pointer allocate(std::size_t size, std::size_t numa_node)
     {
-        if (size <= s_tiny_limit)
-            return {m_tiny_heaps[tiny_bucket_index(size)]->allocate(numa_node)};
-        else if (size <= m_max_size)
-            return {m_heaps[bucket_index(size)]->allocate(numa_node)};
+        if (size > m_max_size) return {get_heap(size).allocate(numa_node)};
+        return {get_pool(size, numa_node).allocate()};
+    }
+
+    // allocate on the calling thread's numa node
+    pointer allocate(std::size_t size)
+    {
+        if (size > m_max_size) return {get_heap(size).allocate()};
+        return {pool_slot(size_class(size), numa().local_node_index(), 0u)->allocate()};
+    }
+
+    // allocate with the given alignment (a power of two up to the page size)
+    pointer allocate(std::size_t size, std::align_val_t alignment, std::size_t numa_node)
+    {
+        const auto a = check_alignment(alignment);
+        size = (std::max<std::size_t>(size, 1u) + a - 1u) / a * a;
+        if (size <= m_max_size)
+        {
+            auto& p = get_pool(size, numa_node);
+            if (p.alignment() >= a) return {p.allocate()};
+        }
+        else if (auto& h = get_heap(size); h.alignment() >= a)
+            return {h.allocate(numa_node)};
+        return {get_aligned_heap(size).allocate(numa_node)};
+    }
+
+    // allocate with the given alignment on the calling thread's numa node
+    pointer allocate(std::size_t size, std::align_val_t alignment)
+    {
+        return allocate(size, alignment, numa().local_node());
+    }
+
+    // allocate a size known at compile time: the size class is resolved at compile time as well
+    template<std::size_t Size>
+    pointer allocate(std::size_t numa_node)
+    {
+        if constexpr (Size > s_max_size) return allocate(Size, numa_node);
         else
         {
-            fixed_size_heap_type* h;
-            {
-                std::lock_guard<std::mutex> lock(m_mutex);
-                const auto                  s = round_to_pow_of_2(size);
-                auto&                       u_ptr = m_huge_heaps[s];
-                if (!u_ptr)
-                    u_ptr = std::make_unique<fixed_size_heap_type>(m_context, s, s, m_never_free,
-                        m_num_reserve_segments);
-                h = u_ptr.get();
-            }
-            return {h->allocate(numa_node)};
+            constexpr auto c = size_class(Size);
+            return {pool_slot(c, node_index(numa_node), 0u)->allocate()};
+        }
+    }
+
+    // allocate a size known at compile time on the calling thread's numa node
+    template<std::size_t Size>
+    pointer allocate()
+    {
+        if constexpr (Size > s_max_size) return allocate(Size);
+        else
+        {
+            constexpr auto c = size_class(Size);
+            return {pool_slot(c, numa().local_node_index(), 0u)->allocate()};
         }
     }
 
+    // allocate from a memory tier (cpu-less hbm or cxl node nearest to numa_node)
+    // spills to dram on numa_node if the tier is not present or exhausted
+    pointer allocate(std::size_t size, std::size_t numa_node, numa_tools::memory_tier tier)
+    {
+        return {get_heap(size).allocate(numa_node, tier)};
+    }
+
     pointer register_user_allocation(void* ptr, std::size_t size)
     {
         auto a = new detail::user_allocation<Context>{m_context, ptr, size};
@@ -223,24 +435,8 @@ class heap
 #if HWMALLOC_ENABLE_DEVICE
     pointer allocate(std::size_t size, std::size_t numa_node, int device_id)
     {
-        if (size <= s_tiny_limit)
-            return {m_tiny_heaps[tiny_bucket_index(size)]->allocate(numa_node, device_id)};
-        else if (size <= m_max_size)
-            return {m_heaps[bucket_index(size)]->allocate(numa_node, device_id)};
-        else
-        {
-            fixed_size_heap_type* h;
-            {
-                std::lock_guard<std::mutex> lock(m_mutex);
-                const auto                  s = round_to_pow_of_2(size);
-                auto&                       u_ptr = m_huge_heaps[s];
-                if (!u_ptr)
-                    u_ptr = std::make_unique<fixed_size_heap_type>(m_context, s, s, m_never_free,
-                        m_num_reserve_segments);
-                h = u_ptr.get();
-            }
-            return {h->allocate(numa_node, device_id)};
-        }
+        if (size > m_max_size) return {get_heap(size).allocate(numa_node, device_id)};
+        return {get_pool(size, numa_node, device_id + 1u).allocate()};
     }
 
     pointer register_user_allocation(void* device_ptr, int device_id, std::size_t size)
@@ -259,23 +455,101 @@ class heap
 #endif
 
     template<typename VoidPtr>
-    void free(hw_void_ptr<block_type, VoidPtr> const& ptr)
+    static void free(hw_void_ptr<block_type, VoidPtr> const& ptr)
     {
         ptr.m_data.release();
     }
 
+    // non-owning pointer to the part [offset, offset + size) of the block of ptr, with handles for
+    // that part; freeing it has no effect. Works for user allocations and sub-pointers as well.
+    static pointer sub_pointer(pointer const& ptr, std::size_t offset, std::size_t size) noexcept
+    {
+        return {ptr.m_data.sub_block(offset, size)};
+    }
+
+    // pointer to the block which starts at the raw address ptr (as returned by get()), found
+    // through the pages of the segments; null if there is no such block in a heap with this
+    // Context. User allocations and sub-pointers are not found.
+    static pointer get_pointer(void const* ptr) noexcept
+    {
+        if (auto s = detail::segment<Context>::find(ptr)) return {s->block_at(ptr)};
+        return {};
+    }
+
+    // resize the memory of ptr to new_size bytes
+    // the block is kept if its size class can hold new_size, otherwise a block is allocated on the
+    // same numa node, memory tier and device, the old block's contents are copied to it and the old
+    // block is freed. The new block has the alignment of its size class. A null ptr is allocated
+    // on the calling thread's numa node. User allocations and sub-pointers cannot be resized.
+    pointer reallocate(pointer const& ptr, std::size_t new_size)
+    {
+        if (!ptr) return allocate(new_size);
+        auto const& b = ptr.m_data;
+        if (!b.m_segment) throw std::invalid_argument("user allocations cannot be reallocated");
+        if (!b.m_owning) throw std::invalid_argument("sub-pointers cannot be reallocated");
+        const auto old_size = b.m_segment->block_size();
+        if (new_size <= old_size) return ptr;
+        auto r = allocate_like(b, new_size);
+        std::memcpy(r.get(), ptr.get(), old_size);
+#if HWMALLOC_ENABLE_DEVICE
+        if (b.on_device())
+        {
+            // staged through the host
+            std::vector<char> tmp(old_size);
+            memcpy_to_host(tmp.data(), b.m_device_ptr, old_size);
+            memcpy_to_device(r.device_ptr(), tmp.data(), old_size);
+        }
+#endif
+        free(ptr);
+        return r;
+    }
+
+    // number of segments which were placed on another node than requested (see
+    // heap_config::numa_fallback)
+    std::size_t num_fallback_segments() const
+    {
+        std::size_t n = 0;
+        for (auto& h : m_tiny_heaps) n += h->num_fallback_segments();
+        for (auto& h : m_heaps) n += h->num_fallback_segments();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& kvp : m_huge_heaps) n += kvp.second->num_fallback_segments();
+        for (auto& kvp : m_aligned_heaps) n += kvp.second->num_fallback_segments();
+        return n;
+    }
+
+    // return the blocks which the calling thread freed on another numa node and which are still
+    // buffered (see heap_config::remote_free_batch); this happens automatically when a buffer is
+    // full and when the thread exits
+    void flush_remote_frees() { fixed_size_heap_type::pool_type::flush_remote_frees(); }
+
+    // move all memory held on node_from to node_to, e.g. after threads were rebound to other cores
+    // the pages of the segments are migrated in place, so that pointers in use stay valid (see
+    // pool::migrate for contexts which require re-registration). Returns the number of migrated
+    // segments.
+    std::size_t migrate(std::size_t node_from, std::size_t node_to)
+    {
+        std::size_t n = 0;
+        for (auto& h : m_tiny_heaps) n += h->migrate(node_from, node_to);
+        for (auto& h : m_heaps) n += h->migrate(node_from, node_to);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& kvp : m_huge_heaps) n += kvp.second->migrate(node_from, node_to);
+        for (auto& kvp : m_aligned_heaps) n += kvp.second->migrate(node_from, node_to);
+        return n;
+    }
+
+    // alignment: minimum alignment of the allocations in addition to alignof(T)
     template<typename T>
-    allocator_type<T> get_allocator(std::size_t numa_node) noexcept
+    allocator_type<T> get_allocator(std::size_t numa_node, std::size_t alignment = 0u) noexcept
     {
-        return {this, numa_node};
+        return {this, numa_node, alignment};
     }
 
-    // scalar version
+    // scalar version, the size class is resolved at compile time
     template<typename T, typename... Args>
     std::enable_if_t<!std::is_array<T>::value, unique_ptr<T>> make_unique(std::size_t numa_node,
         Args&&... args)
     {
-        auto ptr = allocate(sizeof(T), numa_node);
+        auto ptr = allocate<sizeof(T)>(numa_node);
         new (ptr.get()) T(std::forward<Args>(args)...);
         return unique_ptr<T>(static_cast<hw_ptr<T, block_type>>(ptr));
     }
@@ -300,6 +574,8 @@ const std::size_t heap<Context>::s_small_limit;
 template<typename Context>
 const std::size_t heap<Context>::s_large_limit;
 template<typename Context>
+const std::size_t heap<Context>::s_max_size;
+template<typename Context>
 const std::size_t heap<Context>::s_bucket_shift;
 template<typename Context>
 const std::size_t heap<Context>::s_tiny_segment;
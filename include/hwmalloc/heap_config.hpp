@@ -0,0 +1,60 @@
+/*
+ * ghex-org
+ *
+ * Copyright (c) 2014-2023, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <hwmalloc/numa.hpp>
+#include <vector>
+
+namespace hwmalloc
+{
+// Tuning parameters of a heap. They are passed on to every fixed_size_heap and pool that the heap
+// creates.
+struct heap_config
+{
+    using placement = numa_tools::placement;
+    using index_type = numa_tools::index_type;
+
+    // keep all segments alive until the heap is destroyed
+    bool never_free = false;
+    // number of segments a pool keeps even when they are empty
+    std::size_t num_reserve_segments = 1;
+    // how the pages of new segments are placed on the numa nodes
+    placement numa_placement = placement::onnode;
+    // node set used with placement::interleave (empty: all local nodes)
+    std::vector<index_type> interleave_nodes = {};
+    // place new segments on the nearest node of the same memory tier with enough free memory when
+    // the requested node cannot hold them (instead of failing)
+    bool numa_fallback = false;
+    // blocks freed by a thread on another numa node than the block's segment are collected in a
+    // per-thread buffer and returned in batches of this size (0 or 1: return immediately)
+    std::size_t remote_free_batch = 0;
+    // split the free blocks of each pool by last level cache domain (L3 / CCX), threads take blocks
+    // from their own domain's shard and steal from the others when it is empty
+    bool cache_domain_shards = true;
+    // number of slots of the elimination array in front of each pool's free lists: blocks freed
+    // while their segment is contended are handed directly to allocating threads (0: disabled)
+    std::size_t elimination_slots = 0;
+    // upper bound of the pause instructions a contended free waits for an allocating thread to
+    // take its block (the wait adapts up to this bound); a pause takes about 10 to 150 cycles
+    // depending on the processor
+    unsigned elimination_spin = 4;
+    // number of cache colors for pools with power-of-two blocks of at least 2 KiB: successive
+    // segments are shifted by multiples of a cache line (or of the context's required alignment),
+    // so that equal fields of blocks in different segments do not map to the same cache sets
+    // (0 or 1: disabled)
+    std::size_t cache_colors = 0;
+    // track the free blocks of the tiny size classes (up to 128 bytes) in a bitmap per segment
+    // instead of free lists: the threads of a cache domain take blocks in address order from one
+    // published segment, a free sets one bit, and emptiness is a popcount (elimination has no
+    // effect on these classes)
+    bool bitmap_tiny_classes = false;
+};
+
+} // namespace hwmalloc
@@ -0,0 +1,152 @@
+/*
+ * ghex-org
+ *
+ * Copyright (c) 2014-2023, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <hwmalloc/numa.hpp>
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+namespace hwmalloc
+{
+// Heap and numa node used by the local allocators of a heap type: the calling thread's heap if one
+// was set, otherwise the global heap, otherwise Heap::get_instance() (which becomes the global
+// heap). The node is looked up the same way, and defaults to the calling thread's numa node.
+// Lookups are lock-free apart from the last heap fallback, which happens at most once.
+template<typename Heap>
+class heap_registry
+{
+  public:
+    // no node bound: allocate on the calling thread's numa node
+    static constexpr std::size_t any_node = ~std::size_t(0);
+
+  private:
+    static std::atomic<Heap*>& global_heap() noexcept
+    {
+        static std::atomic<Heap*> h{nullptr};
+        return h;
+    }
+
+    static Heap*& local_heap() noexcept
+    {
+        static thread_local Heap* h = nullptr;
+        return h;
+    }
+
+    static std::atomic<std::size_t>& global_node() noexcept
+    {
+        static std::atomic<std::size_t> n{any_node};
+        return n;
+    }
+
+    static std::size_t& local_node() noexcept
+    {
+        static thread_local std::size_t n = any_node;
+        return n;
+    }
+
+  public:
+    // the heap must outlive all allocations made through the registry
+    static void set_global(Heap* heap) noexcept
+    {
+        global_heap().store(heap, std::memory_order_release);
+    }
+
+    // heap of the calling thread (nullptr: use the global heap)
+    static void set_local(Heap* heap) noexcept { local_heap() = heap; }
+
+    // numa node of all threads (any_node: the calling thread's node)
+    static void set_global_node(std::size_t node) noexcept
+    {
+        global_node().store(node, std::memory_order_relaxed);
+    }
+
+    // numa node of the calling thread (any_node: use the global node)
+    static void set_local_node(std::size_t node) noexcept { local_node() = node; }
+
+    static Heap& get()
+    {
+        if (auto h = local_heap()) return *h;
+        if (auto h = global_heap().load(std::memory_order_acquire)) return *h;
+        Heap* expected = nullptr;
+        auto  h = Heap::get_instance().get();
+        if (!global_heap().compare_exchange_strong(expected, h, std::memory_order_acq_rel))
+            h = expected;
+        return *h;
+    }
+
+    static std::size_t node() noexcept
+    {
+        if (auto n = local_node(); n != any_node) return n;
+        if (auto n = global_node().load(std::memory_order_relaxed); n != any_node) return n;
+        return numa().local_node();
+    }
+};
+
+// Stateless allocator with raw pointers for node based containers (std::list, std::map,
+// std::unordered_map, ...). Memory is taken from the registry's heap on the registry's numa node;
+// single objects use the size class of sizeof(T) resolved at compile time. Deallocation
+// finds the block from the raw pointer (see heap::get_pointer), so all instances compare equal
+// and memory may be freed by any thread.
+template<typename T, typename Heap>
+class local_allocator
+{
+  public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using is_always_equal = std::true_type;
+
+    template<typename U>
+    struct rebind
+    {
+        using other = local_allocator<U, Heap>;
+    };
+
+  private:
+    static constexpr bool s_over_aligned = alignof(T) > alignof(std::max_align_t);
+
+  public:
+    local_allocator() noexcept = default;
+
+    template<typename U>
+    local_allocator(local_allocator<U, Heap> const&) noexcept
+    {
+    }
+
+    T* allocate(size_type n)
+    {
+        auto&      h = heap_registry<Heap>::get();
+        const auto node = heap_registry<Heap>::node();
+        if constexpr (s_over_aligned)
+            return static_cast<T*>(
+                h.allocate(n * sizeof(T), std::align_val_t(alignof(T)), node).get());
+        else
+        {
+            if (n == 1u) return static_cast<T*>(h.template allocate<sizeof(T)>(node).get());
+            return static_cast<T*>(h.allocate(n * sizeof(T), node).get());
+        }
+    }
+
+    void deallocate(T* p, size_type) noexcept { Heap::free(Heap::get_pointer(p)); }
+
+    friend bool operator==(local_allocator const&, local_allocator const&) noexcept
+    {
+        return true;
+    }
+
+    friend bool operator!=(local_allocator const&, local_allocator const&) noexcept
+    {
+        return false;
+    }
+};
+
+} // namespace hwmalloc
@@ -0,0 +1,89 @@
+/*
+ * ghex-org
+ *
+ * Copyright (c) 2014-2023, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+namespace hwmalloc
+{
+// Polymorphic memory resource serving a heap's registered memory to std::pmr containers.
+// Allocations are taken from the heap on one numa node with the requested alignment; deallocation
+// finds the block from the raw pointer (see heap::get_pointer), so memory can be returned through
+// any resource on a heap with the same Context.
+template<typename Heap>
+class memory_resource : public std::pmr::memory_resource
+{
+  private:
+    Heap*       m_heap;
+    std::size_t m_numa_node;
+
+  public:
+    memory_resource(Heap& heap, std::size_t numa_node)
+    : m_heap{&heap}
+    , m_numa_node{numa_node}
+    {
+    }
+
+    Heap&       heap() const noexcept { return *m_heap; }
+    std::size_t numa_node() const noexcept { return m_numa_node; }
+
+  private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        return m_heap->allocate(bytes, std::align_val_t(alignment), m_numa_node).get();
+    }
+
+    void do_deallocate(void* ptr, std::size_t, std::size_t) override
+    {
+        m_heap->free(Heap::get_pointer(ptr));
+    }
+
+    bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override
+    {
+        return dynamic_cast<memory_resource const*>(&other) != nullptr;
+    }
+};
+
+// Monotonic variant over an arena (see hwmalloc::arena): deallocation has no effect, release()
+// makes all memory handed out so far invalid and starts over. Not thread safe.
+template<typename Heap>
+class monotonic_memory_resource : public std::pmr::memory_resource
+{
+  private:
+    typename Heap::arena m_arena;
+
+  public:
+    // block_size: size of the blocks the arena takes from the heap
+    monotonic_memory_resource(Heap& heap, std::size_t block_size, std::size_t numa_node)
+    : m_arena{heap, block_size, numa_node}
+    {
+    }
+
+    void release() noexcept { m_arena.reset(); }
+
+    typename Heap::arena& arena() noexcept { return m_arena; }
+
+  private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        return m_arena.allocate(bytes, alignment).get();
+    }
+
+    void do_deallocate(void*, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+} // namespace hwmalloc
@@ -11,6 +11,7 @@
 
 #include <vector>
 #include <algorithm>
+#include <memory>
 
 #ifdef HWMALLOC_NUMA_THROWS
 #define HWMALLOC_NUMA_CONDITIONAL_NOEXCEPT
@@ -28,6 +29,31 @@ class numa_tools
     using index_type = std::size_t;
     using size_type = std::size_t;
 
+    // page placement policies
+    // - onnode:     use libnuma's numa_alloc_onnode and fall back to malloc if the node is not
+    //               available (see allocate(num_pages, node))
+    // - bind:       place pages strictly on the given node, fail if that is not possible
+    // - preferred:  place pages on the given node if possible, on other nodes otherwise
+    // - interleave: spread pages round-robin over a set of nodes
+    enum class placement
+    {
+        onnode,
+        bind,
+        preferred,
+        interleave
+    };
+
+    // memory tiers
+    // - dram: nodes with cpus
+    // - hbm:  cpu-less nodes which are faster than dram (high bandwidth memory in flat mode)
+    // - cxl:  cpu-less nodes which are slower than dram (memory expanders, CXL attached memory)
+    enum class memory_tier
+    {
+        dram,
+        hbm,
+        cxl
+    };
+
     struct allocation
     {
         void* const      ptr = nullptr;
@@ -97,10 +123,22 @@ class numa_tools
     static size_type page_size() noexcept { return numa_tools::page_size_; }
 
   private:
-    std::vector<index_type> m_cpu_to_node;
-    node_map                m_host_nodes;
-    node_map                m_local_nodes;
-    node_map                m_device_nodes;
+    // simulated topology (see numa_topology.hpp)
+    struct topology;
+
+  private:
+    std::unique_ptr<topology>            m_topology;
+    std::vector<index_type>              m_cpu_to_node;
+    std::vector<index_type>              m_cpu_to_local_index;
+    std::vector<index_type>              m_cpu_to_cache_domain;
+    std::vector<size_type>               m_num_cache_domains;
+    node_map                             m_host_nodes;
+    node_map                             m_local_nodes;
+    node_map                             m_device_nodes;
+    index_type                           m_num_nodes = 0;
+    std::vector<int>                     m_distances;
+    std::vector<std::vector<index_type>> m_nearest_nodes;
+    std::vector<memory_tier>             m_node_tiers;
 
   private:
     numa_tools() HWMALLOC_NUMA_CONDITIONAL_NOEXCEPT;
@@ -110,20 +148,66 @@ class numa_tools
     ~numa_tools() noexcept;
 
   public:
+    // true if the topology is simulated through the HWMALLOC_NUMA_TOPOLOGY environment variable
+    bool        is_simulated() const noexcept { return (bool)m_topology; }
     const auto& host_nodes() const noexcept { return m_host_nodes; }
     const auto& local_nodes() const noexcept { return m_local_nodes; }
     const auto& device_nodes() const noexcept { return m_device_nodes; }
-    index_type  local_node() const noexcept;
+    // numa node of the calling thread
+    // the value is cached per thread and refreshed when the thread migrates to another cpu
+    index_type local_node() const noexcept;
+    // index of the calling thread's node within local_nodes() (0 if the node is not local)
+    index_type local_node_index() const noexcept;
+    // index of the calling thread's last level cache domain (L3 / CCX) within its node
+    index_type cache_domain() const noexcept;
+    // number of last level cache domains of a node (at least 1)
+    size_type num_cache_domains(index_type node) const noexcept;
+
+    // distance between two nodes as reported by the firmware (10 = local), 0 if unknown
+    int distance(index_type a, index_type b) const noexcept;
+    // nodes with memory ordered by increasing distance from node, starting with node itself
+    // (empty if node has no memory)
+    const std::vector<index_type>& nearest_nodes(index_type node) const noexcept;
+    // currently free memory on node in bytes
+    size_type free_memory(index_type node) const noexcept;
+    // memory tier of a node
+    memory_tier tier_of(index_type node) const noexcept;
 
     bool       can_allocate_on(index_type node) const noexcept;
     allocation allocate(size_type num_pages) const noexcept;
     allocation allocate(size_type num_pages, index_type node) const noexcept;
     allocation allocate_malloc(size_type num_pages) const noexcept;
+    // allocate with an explicit placement policy, no malloc fallback is attempted
+    // placement::interleave spreads the pages over all local nodes
+    // the returned allocation's node is always the requested node
+    allocation allocate(size_type num_pages, index_type node, placement p) const noexcept;
+    // spread the pages over the given node set, the returned allocation's node is the first node
+    allocation allocate_interleaved(
+        size_type num_pages, std::vector<index_type> const& nodes) const noexcept;
     void       free(allocation const& a) const noexcept;
     index_type get_node(void* ptr) const noexcept;
+    // move the pages of an allocation to another node (and bind them there)
+    // returns false if not all pages could be moved
+    bool migrate(allocation const& a, index_type node) const noexcept;
 
   private:
     void discover_nodes() noexcept;
+    void discover_distances() noexcept;
+    void discover_tiers() noexcept;
+    void discover_cache_domains() noexcept;
+    // sort the memory nodes by distance from each node
+    void discover_nearest_nodes(std::vector<index_type> const& memory_nodes) noexcept;
+    // tier of a cpu-less node judged by its distance to the cpu nodes
+    memory_tier distance_tier(index_type node) const noexcept;
+
+    // simulated topology
+    void       discover_simulated_nodes() noexcept;
+    allocation allocate_simulated(
+        size_type num_pages, std::vector<index_type> const& nodes, placement p) const noexcept;
+    void       free_simulated(allocation const& a) const noexcept;
+    bool       migrate_simulated(allocation const& a, index_type node) const noexcept;
+    index_type get_simulated_node(void* ptr) const noexcept;
+    size_type  simulated_free_memory(index_type node) const noexcept;
 };
 
 const numa_tools& numa() noexcept;
@@ -0,0 +1,219 @@
+/*
+ * ghex-org
+ *
+ * Copyright (c) 2014-2023, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <hwmalloc/fancy_ptr/unique_ptr.hpp>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace hwmalloc
+{
+// Pool of objects of type T which are kept constructed when they are given back.
+// The unique pointers handed out by get() return their object to the calling thread's cache of the
+// pool instead of destroying it, after applying the optional reset hook (which must not throw: an
+// object whose reset fails is destroyed instead of being cached). get() takes objects from
+// that cache first, so that the common path neither allocates nor constructs. Each thread caches
+// at most cache_size objects, half of them are passed on to a list shared by all threads when the
+// cache overflows. All objects, including those in the caches of other threads, are destroyed when
+// the pool is destroyed. The pool must outlive the unique pointers it hands out, and must not be
+// destroyed while other threads use it.
+template<typename T, typename Heap>
+class object_pool : private object_recycler<T, typename Heap::block_type>
+{
+  public:
+    using block_type = typename Heap::block_type;
+    using pointer = hw_ptr<T, block_type>;
+    using unique_ptr = hwmalloc::unique_ptr<T, block_type>;
+    using reset_type = std::function<void(T&)>;
+
+  private:
+    struct cache;
+
+    // objects shared by all threads, kept alive by the thread caches after the pool is gone
+    struct shared_state
+    {
+        std::mutex           mutex;
+        bool                 alive = true;
+        std::vector<pointer> objects;
+        std::vector<cache*>  caches; // of all threads, emptied when the pool is destroyed
+    };
+
+    struct cache
+    {
+        std::shared_ptr<shared_state> state;
+        std::vector<pointer>          objects;
+    };
+
+    // all caches of a thread, given back when the thread exits
+    struct thread_caches
+    {
+        std::unordered_map<shared_state*, cache> caches;
+
+        ~thread_caches()
+        {
+            for (auto& kvp : caches) unregister(kvp.second);
+        }
+    };
+
+    static thread_caches& get_thread_caches()
+    {
+        static thread_local thread_caches c;
+        return c;
+    }
+
+    static void destroy(pointer p) noexcept
+    {
+        p->~T();
+        p.release();
+    }
+
+    // move the last n objects of a cache to the shared list
+    static void give_back(cache& c, std::size_t n)
+    {
+        std::lock_guard<std::mutex> lock(c.state->mutex);
+        const auto                  first = c.objects.end() - n;
+        c.state->objects.insert(c.state->objects.end(), first, c.objects.end());
+        c.objects.erase(first, c.objects.end());
+    }
+
+    // give back the objects of an exiting thread's cache, unless the pool is gone (then it has
+    // destroyed them already)
+    static void unregister(cache& c)
+    {
+        std::lock_guard<std::mutex> lock(c.state->mutex);
+        auto&                       state = *c.state;
+        if (!state.alive) return;
+        state.objects.insert(state.objects.end(), c.objects.begin(), c.objects.end());
+        c.objects.clear();
+        state.caches.erase(std::find(state.caches.begin(), state.caches.end(), &c));
+    }
+
+  private:
+    Heap*                         m_heap;
+    std::size_t                   m_numa_node;
+    reset_type                    m_reset;
+    std::size_t                   m_cache_size;
+    std::shared_ptr<shared_state> m_state;
+
+  public:
+    object_pool(Heap& heap, std::size_t numa_node, reset_type reset = {},
+        std::size_t cache_size = 64)
+    : m_heap{&heap}
+    , m_numa_node{numa_node}
+    , m_reset{std::move(reset)}
+    , m_cache_size{std::max<std::size_t>(cache_size, 2u)}
+    , m_state{std::make_shared<shared_state>()}
+    {
+    }
+
+    object_pool(object_pool const&) = delete;
+
+    // the objects are destroyed while the heap is still alive, the caches of threads which outlive
+    // the pool are left empty
+    ~object_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_state->mutex);
+            m_state->alive = false;
+            for (auto c : m_state->caches)
+            {
+                for (auto& p : c->objects) destroy(p);
+                c->objects.clear();
+            }
+            m_state->caches.clear();
+            for (auto& p : m_state->objects) destroy(p);
+            m_state->objects.clear();
+        }
+        get_thread_caches().caches.erase(m_state.get());
+    }
+
+    // a cached object, in the state left by the reset hook, if there is one; otherwise a new object
+    // constructed from args
+    template<typename... Args>
+    unique_ptr get(Args&&... args)
+    {
+        auto& c = local_cache();
+        if (c.objects.empty()) refill(c);
+        if (!c.objects.empty())
+        {
+            const auto p = c.objects.back();
+            c.objects.pop_back();
+            return unique_ptr(p, heap_delete<T, block_type>{this});
+        }
+        auto p = static_cast<pointer>(m_heap->template allocate<sizeof(T)>(m_numa_node));
+        try
+        {
+            new (p.get()) T(std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            p.release();
+            throw;
+        }
+        return unique_ptr(p, heap_delete<T, block_type>{this});
+    }
+
+  private:
+    cache& local_cache()
+    {
+        auto& c = get_thread_caches().caches[m_state.get()];
+        if (!c.state)
+        {
+            // set up completely or not at all (retried on the next call)
+            c.objects.reserve(m_cache_size + 1u);
+            std::lock_guard<std::mutex> lock(m_state->mutex);
+            m_state->caches.push_back(&c);
+            c.state = m_state;
+        }
+        return c;
+    }
+
+    // take up to half a cache's worth of objects from the shared list
+    void refill(cache& c)
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        auto&                       objects = m_state->objects;
+        const auto                  n = std::min(objects.size(), m_cache_size / 2u);
+        c.objects.insert(c.objects.end(), objects.end() - n, objects.end());
+        objects.erase(objects.end() - n, objects.end());
+    }
+
+    // called by the deleter of the unique pointers: nothing may escape
+    void recycle(pointer const& p) noexcept override
+    {
+        cache* c = nullptr;
+        try
+        {
+            if (m_reset) m_reset(*p);
+            c = &local_cache();
+            c->objects.push_back(p); // within the reserved capacity
+        }
+        catch (...)
+        {
+            destroy(p);
+            return;
+        }
+        try
+        {
+            if (c->objects.size() > m_cache_size) give_back(*c, c->objects.size() / 2u);
+        }
+        catch (...)
+        {
+            // the objects stay in the cache until the next attempt
+        }
+    }
+};
+
+} // namespace hwmalloc
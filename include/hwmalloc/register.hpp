@@ -62,6 +62,23 @@ namespace hwmalloc
 // | h.get_remote_key()  | unspecified    | returns rma key for remote access                     |
 // +---------------------+----------------+-------------------------------------------------------+
 //
+// Optionally, the function
+//
+//     bool requires_reregistration(Context const& context)
+//
+// is found by ADL and tells whether registered memory has to be registered again after its pages
+// were migrated to another numa node (e.g. because the registration pins the physical pages). In
+// that case only segments without blocks in use are migrated, and they are deregistered before and
+// registered again after the move. Without this function registrations are assumed to stay valid.
+//
+// Optionally, the function
+//
+//     std::size_t required_alignment(Context const& context)
+//
+// is found by ADL and returns the alignment (a power of two) which the context needs for the
+// addresses of registered buffers. It limits how far blocks may be shifted for cache coloring (see
+// heap_config::cache_colors). Without this function blocks are aligned to at least a cache line.
+//
 
 namespace detail
 {
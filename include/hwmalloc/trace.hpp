@@ -0,0 +1,80 @@
+/*
+ * ghex-org
+ *
+ * Copyright (c) 2014-2023, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <hwmalloc/config.hpp>
+
+// use the macro HWMALLOC_TRACE(EVENT, ARG0, ARG1) to record an allocator event
+// the event is stored in a per-thread binary ring buffer: recording takes no locks and does not
+// format anything (the buffer is allocated on a thread's first event); the buffers can be dumped in
+// Chrome trace format
+#ifdef HWMALLOC_ENABLE_TRACING
+#define HWMALLOC_TRACE(EVENT, ARG0, ARG1)                                                          \
+    ::hwmalloc::trace::record(::hwmalloc::trace::event::EVENT, (std::uint64_t)(ARG0),              \
+        (std::uint64_t)(ARG1))
+#else
+#define HWMALLOC_TRACE(EVENT, ARG0, ARG1)
+#endif
+
+// implementation
+#ifdef HWMALLOC_ENABLE_TRACING
+#include <cstdint>
+#include <iosfwd>
+
+namespace hwmalloc
+{
+namespace trace
+{
+// recorded event kinds
+// begin/end pairs are exported as duration events, all others as instant events
+enum class event : std::uint32_t
+{
+    segment_add,     // a new segment was added to a pool:        ptr, size
+    segment_remove,  // a segment was destroyed:                  ptr, size
+    register_begin,  // registration with the context started:    ptr, size
+    register_end,    // registration with the context finished:   ptr, size
+    slow_path_begin, // a pool entered its allocation slow path:  block size, numa node
+    slow_path_end,   // a pool left its allocation slow path:     block size, numa node
+    trim,            // a pool released an empty segment:         block size, remaining segments
+    budget,          // a pool could not grow within its budget:  block size, numa node
+    fallback,        // a segment was placed on another node:     block size, numa node
+    migrate          // a segment was moved to another node:      ptr, numa node
+};
+
+// binary layout of a single event (32 bytes)
+struct record_type
+{
+    std::uint64_t timestamp; // nanoseconds, see now()
+    event         kind;
+    std::uint32_t reserved;
+    std::uint64_t arg0;
+    std::uint64_t arg1;
+};
+
+// monotonic time stamp in nanoseconds, use for correlating with other timelines
+std::uint64_t now() noexcept;
+
+// record an event into the calling thread's ring buffer
+// (dropped if the thread has no buffer and none can be allocated)
+void record(event e, std::uint64_t arg0, std::uint64_t arg1) noexcept;
+
+// discard all recorded events of all threads
+// not synchronized with concurrent recording
+void clear() noexcept;
+
+// write the events of all threads as Chrome trace / Perfetto JSON (those of exited threads until
+// their buffer is reused by a new thread)
+// not synchronized with concurrent recording: call when allocator activity is quiescent
+void write_chrome_trace(std::ostream& os);
+bool write_chrome_trace(char const* filename);
+
+} // namespace trace
+} // namespace hwmalloc
+#endif
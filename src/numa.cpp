@@ -7,7 +7,7 @@
  * Please, refer to the LICENSE file in the root directory.
  * SPDX-License-Identifier: BSD-3-Clause
  */
-#include <hwmalloc/numa.hpp>
+#include "./numa_topology.hpp"
 #include <hwmalloc/log.hpp>
 #include <numaif.h>
 #include <numa.h>
@@ -16,6 +16,16 @@
 #include <cstdlib>
 #include <cstdint>
 #include <sys/sysinfo.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fstream>
+#include <string>
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#endif
+#if defined(RSEQ_SIG) && (defined(__x86_64__) || defined(__aarch64__))
+#define HWMALLOC_HAVE_RSEQ
+#endif
 
 #ifdef HWMALLOC_NUMA_THROWS
 #include <stdexcept>
@@ -34,14 +44,92 @@ numa_tools::size_type numa_tools::page_size_ = sysconf(_SC_PAGESIZE);
 
 namespace
 {
-bitmask* task_cpu_mask_ptr;
+bitmask* task_cpu_mask_ptr = nullptr;
+
+// cpu of the calling thread
+// read from the thread's rseq area if glibc registered one (a plain load), otherwise use
+// sched_getcpu which goes through the vDSO
+inline int
+current_cpu() noexcept
+{
+#ifdef HWMALLOC_HAVE_RSEQ
+    if (__rseq_size > 0)
+    {
+        auto rs = reinterpret_cast<struct rseq const volatile*>(
+            static_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+        const int cpu = static_cast<int>(rs->cpu_id);
+        if (cpu >= 0) return cpu;
+    }
+#endif
+    return sched_getcpu();
+}
+
+// per-thread cache of the current cpu and its node
+struct cpu_cache
+{
+    int                    cpu = -1;
+    numa_tools::index_type node = 0;
+    numa_tools::index_type local_index = 0;
+    numa_tools::index_type cache_domain = 0;
+};
+
+thread_local cpu_cache cpu_cache_;
+
+// memory tier id of each node as assigned by the kernel (linux >= 6.1), empty if not available
+std::vector<int>
+kernel_memory_tiers(numa_tools::index_type num_nodes)
+{
+    std::vector<int> tiers;
+    const char*      path = "/sys/devices/virtual/memory_tiering";
+    DIR*             dir = opendir(path);
+    if (!dir) return tiers;
+    tiers.assign(num_nodes, -1);
+    while (auto entry = readdir(dir))
+    {
+        const std::string name = entry->d_name;
+        const std::string prefix = "memory_tier";
+        if (name.compare(0, prefix.size(), prefix) != 0 || name.size() == prefix.size()) continue;
+        std::ifstream f(std::string(path) + "/" + name + "/nodelist");
+        std::string   nodelist;
+        if (!(f >> nodelist)) continue;
+        const int tier = std::atoi(name.c_str() + prefix.size());
+        for (auto n : parse_list(nodelist))
+            if (n < num_nodes) tiers[n] = tier;
+    }
+    closedir(dir);
+    return tiers;
 }
 
+// first cpu sharing the level 3 cache with cpu, -1 if unknown
+long
+l3_cache_leader(int cpu)
+{
+    const std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/cache/index";
+    for (int i = 0;; ++i)
+    {
+        std::ifstream level_file(path + std::to_string(i) + "/level");
+        int           level = 0;
+        if (!(level_file >> level)) break;
+        if (level != 3) continue;
+        std::ifstream list_file(path + std::to_string(i) + "/shared_cpu_list");
+        std::string   list;
+        if (!(list_file >> list)) break;
+        const auto cpus = parse_list(list);
+        if (!cpus.empty()) return *std::min_element(cpus.begin(), cpus.end());
+        break;
+    }
+    return -1;
+}
+} // namespace
+
 // construct the single instance
 numa_tools::numa_tools() HWMALLOC_NUMA_CONDITIONAL_NOEXCEPT
 {
+    m_topology = topology::load();
+    if (m_topology) discover_simulated_nodes();
     // initialize libnuma
-    if (numa_available() < 0) HWMALLOC_NUMA_ERROR("could not initialize libnuma");
+    else if (numa_available() < 0)
+        HWMALLOC_NUMA_ERROR("could not initialize libnuma");
     else
     {
         task_cpu_mask_ptr = numa_allocate_cpumask();
@@ -50,7 +138,10 @@ numa_tools::numa_tools() HWMALLOC_NUMA_CONDITIONAL_NOEXCEPT
     }
 }
 
-numa_tools::~numa_tools() noexcept { numa_free_cpumask(task_cpu_mask_ptr); }
+numa_tools::~numa_tools() noexcept
+{
+    if (task_cpu_mask_ptr) numa_free_cpumask(task_cpu_mask_ptr);
+}
 
 // detect host and device nodes
 void
@@ -74,6 +165,15 @@ numa_tools::discover_nodes() noexcept
     local_nodes_.resize(
         std::unique(local_nodes_.begin(), local_nodes_.end()) - local_nodes_.begin());
 
+    // flattened cpu -> local node index map
+    m_cpu_to_local_index.resize(m_cpu_to_node.size(), 0);
+    for (std::size_t cpu = 0; cpu < m_cpu_to_node.size(); ++cpu)
+    {
+        auto it = std::lower_bound(local_nodes_.begin(), local_nodes_.end(), m_cpu_to_node[cpu]);
+        if (it != local_nodes_.end() && *it == m_cpu_to_node[cpu])
+            m_cpu_to_local_index[cpu] = it - local_nodes_.begin();
+    }
+
     // allocate a cpu mask
     auto cpu_mask_ptr = numa_allocate_cpumask();
     // get maximum number of nodes
@@ -100,13 +200,122 @@ numa_tools::discover_nodes() noexcept
     m_local_nodes = node_map(std::move(local_nodes_));
     m_device_nodes = node_map(std::move(device_nodes_));
 
+    discover_distances();
+    discover_tiers();
+    discover_cache_domains();
+
     is_initialized_ = true;
 }
 
+// load the node distance matrix and sort the memory nodes by distance
+void
+numa_tools::discover_distances() noexcept
+{
+    m_num_nodes = numa_max_node() + 1;
+    m_distances.assign(m_num_nodes * m_num_nodes, 0);
+
+    std::vector<index_type> memory_nodes;
+    for (index_type i = 0; i < m_num_nodes; ++i)
+        if (numa_bitmask_isbitset(numa_all_nodes_ptr, i)) memory_nodes.push_back(i);
+
+    for (auto i : memory_nodes)
+        for (auto j : memory_nodes) m_distances[i * m_num_nodes + j] = numa_distance(i, j);
+
+    discover_nearest_nodes(memory_nodes);
+}
+
+// classify cpu-less nodes as faster (hbm) or slower (cxl) than dram
+// the kernel's memory tiers are used when available, otherwise a cpu-less node counts as hbm when
+// it is closer to some cpu than the nearest remote dram node
+void
+numa_tools::discover_tiers() noexcept
+{
+    m_node_tiers.assign(m_num_nodes, memory_tier::dram);
+    if (device_nodes().size() == 0u) return;
+
+    const auto kernel_tiers = kernel_memory_tiers(m_num_nodes);
+    int        dram_tier = -1;
+    for (auto [h, i] : host_nodes())
+        if (h < kernel_tiers.size() && kernel_tiers[h] >= 0)
+            dram_tier = (dram_tier < 0) ? kernel_tiers[h] : std::min(dram_tier, kernel_tiers[h]);
+
+    for (auto [d, i] : device_nodes())
+    {
+        if (d >= m_num_nodes) continue;
+        const int kernel_tier = (d < kernel_tiers.size()) ? kernel_tiers[d] : -1;
+        if (dram_tier >= 0 && kernel_tier >= 0 && kernel_tier != dram_tier)
+            m_node_tiers[d] = (kernel_tier < dram_tier) ? memory_tier::hbm : memory_tier::cxl;
+        else
+            m_node_tiers[d] = distance_tier(d);
+    }
+}
+
+// group the cpus of each node by the level 3 cache they share
+// nodes without cache information form a single domain
+void
+numa_tools::discover_cache_domains() noexcept
+{
+    std::vector<long>              leaders(m_cpu_to_node.size());
+    std::vector<std::vector<long>> node_leaders(m_num_nodes);
+    for (std::size_t cpu = 0; cpu < m_cpu_to_node.size(); ++cpu)
+    {
+        leaders[cpu] = l3_cache_leader(cpu);
+        if (m_cpu_to_node[cpu] < m_num_nodes)
+            node_leaders[m_cpu_to_node[cpu]].push_back(leaders[cpu]);
+    }
+    m_num_cache_domains.assign(m_num_nodes, 1u);
+    for (index_type n = 0; n < m_num_nodes; ++n)
+    {
+        auto& l = node_leaders[n];
+        std::sort(l.begin(), l.end());
+        l.erase(std::unique(l.begin(), l.end()), l.end());
+        m_num_cache_domains[n] = std::max<size_type>(l.size(), 1u);
+    }
+    m_cpu_to_cache_domain.assign(m_cpu_to_node.size(), 0u);
+    for (std::size_t cpu = 0; cpu < m_cpu_to_node.size(); ++cpu)
+    {
+        if (m_cpu_to_node[cpu] >= m_num_nodes) continue;
+        auto const& l = node_leaders[m_cpu_to_node[cpu]];
+        m_cpu_to_cache_domain[cpu] =
+            std::lower_bound(l.begin(), l.end(), leaders[cpu]) - l.begin();
+    }
+}
+
+numa_tools::size_type
+numa_tools::free_memory(index_type node) const noexcept
+{
+    if (m_topology) return simulated_free_memory(node);
+    long long free_size = 0;
+    if (numa_node_size64(node, &free_size) < 0) return 0u;
+    return static_cast<size_type>(free_size);
+}
+
 numa_tools::index_type
 numa_tools::local_node() const noexcept
 {
-    return m_cpu_to_node[sched_getcpu()];
+    const int cpu = current_cpu();
+    if (cpu != cpu_cache_.cpu)
+    {
+        cpu_cache_.cpu = cpu;
+        cpu_cache_.node = m_cpu_to_node[cpu];
+        cpu_cache_.local_index = m_cpu_to_local_index[cpu];
+        cpu_cache_.cache_domain = m_cpu_to_cache_domain[cpu];
+    }
+    return cpu_cache_.node;
+}
+
+numa_tools::index_type
+numa_tools::local_node_index() const noexcept
+{
+    local_node();
+    return cpu_cache_.local_index;
+}
+
+numa_tools::index_type
+numa_tools::cache_domain() const noexcept
+{
+    local_node();
+    return cpu_cache_.cache_domain;
 }
 
 bool
@@ -125,6 +334,7 @@ numa_tools::allocation
 numa_tools::allocate(size_type num_pages, index_type node) const noexcept
 {
     if (num_pages == 0u) return {};
+    if (m_topology) return allocate_simulated(num_pages, {node}, placement::onnode);
 #ifndef HWMALLOC_NUMA_FOR_LOCAL
     // bypass numa allocation if on local node
     if (node == local_node()) return allocate_malloc(num_pages);
@@ -139,6 +349,74 @@ numa_tools::allocate(size_type num_pages, index_type node) const noexcept
     return {ptr, num_pages * page_size_, node};
 }
 
+numa_tools::allocation
+numa_tools::allocate(size_type num_pages, index_type node, placement p) const noexcept
+{
+    switch (p)
+    {
+        case placement::onnode: return allocate(num_pages, node);
+        case placement::interleave:
+        {
+            std::vector<index_type> nodes;
+            nodes.reserve(local_nodes().size() + 1);
+            nodes.push_back(node);
+            for (auto [n, i] : local_nodes())
+                if (n != node) nodes.push_back(n);
+            return allocate_interleaved(num_pages, nodes);
+        }
+        default: break;
+    }
+    if (num_pages == 0u) return {};
+    if (m_topology) return allocate_simulated(num_pages, {node}, p);
+    // only nodes with memory can be bound to
+    if (p == placement::bind && !numa_bitmask_isbitset(numa_all_nodes_ptr, node)) return {};
+    const auto size = num_pages * page_size_;
+    void*      ptr =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) return {};
+    if (numa_bitmask_isbitset(numa_all_nodes_ptr, node))
+    {
+        auto mask = numa_allocate_nodemask();
+        numa_bitmask_setbit(mask, node);
+        const int ret = mbind(ptr, size, (p == placement::bind ? MPOL_BIND : MPOL_PREFERRED),
+            mask->maskp, mask->size + 1, 0);
+        numa_free_nodemask(mask);
+        if (ret != 0 && p == placement::bind)
+        {
+            munmap(ptr, size);
+            return {};
+        }
+    }
+    HWMALLOC_LOG("allocating", size, "bytes using mmap/mbind:", (std::uintptr_t)ptr);
+    return {ptr, size, node};
+}
+
+numa_tools::allocation
+numa_tools::allocate_interleaved(
+    size_type num_pages, std::vector<index_type> const& nodes) const noexcept
+{
+    if (num_pages == 0u || nodes.empty()) return {};
+    if (m_topology) return allocate_simulated(num_pages, nodes, placement::interleave);
+    const auto size = num_pages * page_size_;
+    void*      ptr =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) return {};
+    auto mask = numa_allocate_nodemask();
+    for (auto n : nodes)
+        if (numa_bitmask_isbitset(numa_all_nodes_ptr, n)) numa_bitmask_setbit(mask, n);
+    const int ret = (numa_bitmask_weight(mask) > 0)
+                        ? mbind(ptr, size, MPOL_INTERLEAVE, mask->maskp, mask->size + 1, 0)
+                        : -1;
+    numa_free_nodemask(mask);
+    if (ret != 0)
+    {
+        munmap(ptr, size);
+        return {};
+    }
+    HWMALLOC_LOG("allocating", size, "bytes using mmap/mbind (interleaved):", (std::uintptr_t)ptr);
+    return {ptr, size, nodes.front()};
+}
+
 numa_tools::allocation
 numa_tools::allocate_malloc(size_type num_pages) const noexcept
 {
@@ -153,6 +431,7 @@ numa_tools::allocate_malloc(size_type num_pages) const noexcept
 numa_tools::index_type
 numa_tools::get_node(void* ptr) const noexcept
 {
+    if (m_topology) return get_simulated_node(ptr);
     int node_id = 0;
     get_mempolicy(&node_id, // mode: node id
         NULL,               // nodemask:  ignore
@@ -164,12 +443,30 @@ numa_tools::get_node(void* ptr) const noexcept
     return static_cast<index_type>(node_id);
 }
 
+bool
+numa_tools::migrate(allocation const& a, index_type node) const noexcept
+{
+    if (!a) return false;
+    if (m_topology) return migrate_simulated(a, node);
+    // only whole pages can be moved
+    if ((std::uintptr_t)a.ptr % page_size_ != 0u) return false;
+    if (!numa_bitmask_isbitset(numa_all_nodes_ptr, node)) return false;
+    auto mask = numa_allocate_nodemask();
+    numa_bitmask_setbit(mask, node);
+    const int ret = mbind(a.ptr, a.size, MPOL_BIND, mask->maskp, mask->size + 1,
+        MPOL_MF_MOVE | MPOL_MF_STRICT);
+    numa_free_nodemask(mask);
+    HWMALLOC_LOG("migrating ", a.size, "bytes to node", node, ":", (std::uintptr_t)a.ptr);
+    return ret == 0;
+}
+
 void
 numa_tools::free(numa_tools::allocation const& a) const noexcept
 {
     if (a)
     {
-        if (a.use_numa_free)
+        if (a.use_numa_free && m_topology) free_simulated(a);
+        else if (a.use_numa_free)
         {
             HWMALLOC_LOG("freeing   ", a.size, "bytes using numa_free:", (std::uintptr_t)a.ptr);
             numa_free(a.ptr, a.size);
@@ -7,20 +7,40 @@
  * Please, refer to the LICENSE file in the root directory.
  * SPDX-License-Identifier: BSD-3-Clause
  */
-#include <hwmalloc/numa.hpp>
+#include "./numa_topology.hpp"
 #include <hwmalloc/log.hpp>
 #include <unistd.h>
 #include <cstdlib>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 namespace hwmalloc
 {
 bool                  numa_tools::is_initialized_ = false;
 numa_tools::size_type numa_tools::page_size_ = sysconf(_SC_PAGESIZE);
 
+namespace
+{
+// cpu of the calling thread (0 if unknown)
+inline std::size_t
+current_cpu() noexcept
+{
+#ifdef __linux__
+    const int cpu = sched_getcpu();
+    if (cpu >= 0) return cpu;
+#endif
+    return 0u;
+}
+} // namespace
+
 // construct the single instance
 numa_tools::numa_tools() HWMALLOC_NUMA_CONDITIONAL_NOEXCEPT
 {
-    discover_nodes();
+    m_topology = topology::load();
+    if (m_topology) discover_simulated_nodes();
+    else
+        discover_nodes();
 }
 
 numa_tools::~numa_tools() noexcept {}
@@ -30,13 +50,57 @@ void
 numa_tools::discover_nodes() noexcept
 {
     m_local_nodes = node_map({0});
+    discover_distances();
+    discover_tiers();
+    discover_cache_domains();
     is_initialized_ = true;
 }
 
+void
+numa_tools::discover_distances() noexcept
+{
+    m_num_nodes = 1;
+    m_distances.assign(1, 10);
+    discover_nearest_nodes({0});
+}
+
+void
+numa_tools::discover_tiers() noexcept
+{
+    m_node_tiers.assign(1, memory_tier::dram);
+}
+
+void
+numa_tools::discover_cache_domains() noexcept
+{
+    m_num_cache_domains.assign(1, 1u);
+}
+
+numa_tools::size_type
+numa_tools::free_memory(index_type node) const noexcept
+{
+    if (m_topology) return simulated_free_memory(node);
+    return static_cast<size_type>(sysconf(_SC_AVPHYS_PAGES)) * page_size_;
+}
+
 numa_tools::index_type
 numa_tools::local_node() const noexcept
 {
-    return static_cast<index_type>(0);
+    if (!m_topology) return static_cast<index_type>(0);
+    return m_cpu_to_node[current_cpu() % m_cpu_to_node.size()];
+}
+
+numa_tools::index_type
+numa_tools::local_node_index() const noexcept
+{
+    return m_local_nodes.find(local_node())->second;
+}
+
+numa_tools::index_type
+numa_tools::cache_domain() const noexcept
+{
+    if (!m_topology) return static_cast<index_type>(0);
+    return m_cpu_to_cache_domain[current_cpu() % m_cpu_to_cache_domain.size()];
 }
 
 bool
@@ -52,12 +116,38 @@ numa_tools::allocate(size_type num_pages) const noexcept
 }
 
 numa_tools::allocation
-numa_tools::allocate(size_type num_pages, index_type /*node*/) const noexcept
+numa_tools::allocate(size_type num_pages, index_type node) const noexcept
 {
     if (num_pages == 0u) return {};
+    if (m_topology) return allocate_simulated(num_pages, {node}, placement::onnode);
     return allocate_malloc(num_pages);
 }
 
+numa_tools::allocation
+numa_tools::allocate(size_type num_pages, index_type node, placement p) const noexcept
+{
+    if (m_topology)
+    {
+        if (p != placement::interleave) return allocate_simulated(num_pages, {node}, p);
+        std::vector<index_type> nodes{node};
+        for (auto [n, i] : local_nodes())
+            if (n != node) nodes.push_back(n);
+        return allocate_simulated(num_pages, nodes, p);
+    }
+    // only node 0 exists
+    if (p == placement::bind && node != 0u) return {};
+    return allocate(num_pages, node);
+}
+
+numa_tools::allocation
+numa_tools::allocate_interleaved(
+    size_type num_pages, std::vector<index_type> const& nodes) const noexcept
+{
+    if (nodes.empty()) return {};
+    if (m_topology) return allocate_simulated(num_pages, nodes, placement::interleave);
+    return allocate(num_pages, nodes.front());
+}
+
 numa_tools::allocation
 numa_tools::allocate_malloc(size_type num_pages) const noexcept
 {
@@ -70,15 +160,25 @@ numa_tools::allocate_malloc(size_type num_pages) const noexcept
 }
 
 numa_tools::index_type
-numa_tools::get_node(void* /*ptr*/) const noexcept
+numa_tools::get_node(void* ptr) const noexcept
 {
+    if (m_topology) return get_simulated_node(ptr);
     return static_cast<index_type>(0);
 }
 
+bool
+numa_tools::migrate(allocation const& a, index_type node) const noexcept
+{
+    if (!a) return false;
+    if (m_topology) return migrate_simulated(a, node);
+    return node == 0u;
+}
+
 void
 numa_tools::free(numa_tools::allocation const& a) const noexcept
 {
-    if (a)
+    if (a && a.use_numa_free && m_topology) free_simulated(a);
+    else if (a)
     {
         HWMALLOC_LOG("freeing   ", a.size, "bytes using std::free:", (std::uintptr_t)a.ptr);
         std::free(a.ptr);
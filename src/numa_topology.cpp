@@ -0,0 +1,453 @@
+/*
+ * ghex-org
+ *
+ * Copyright (c) 2014-2023, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "./numa_topology.hpp"
+#include <hwmalloc/log.hpp>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#ifdef HWMALLOC_NUMA_THROWS
+#include <stdexcept>
+#define HWMALLOC_TOPOLOGY_ERROR(MSG)                                                               \
+    throw std::runtime_error(std::string("numa topology error: ") + MSG)
+#else
+#include <iostream>
+#define HWMALLOC_TOPOLOGY_ERROR(MSG)                                                               \
+    do {                                                                                           \
+        std::cerr << "numa topology error: " << MSG << "\n";                                       \
+        return {};                                                                                 \
+    } while (false)
+#endif
+
+// This file holds the parts of numa_tools which do not depend on libnuma: the distance and tier
+// bookkeeping and the simulated topology.
+
+namespace hwmalloc
+{
+std::vector<numa_tools::index_type>
+parse_list(std::string const& str)
+{
+    std::vector<numa_tools::index_type> list;
+    std::size_t                         pos = 0;
+    while (pos < str.size())
+    {
+        auto end = str.find(',', pos);
+        if (end == std::string::npos) end = str.size();
+        const auto item = str.substr(pos, end - pos);
+        const auto dash = item.find('-');
+        try
+        {
+            const auto first = std::stoul(item.substr(0, dash));
+            const auto last =
+                (dash == std::string::npos) ? first : std::stoul(item.substr(dash + 1));
+            for (auto i = first; i <= last; ++i) list.push_back(i);
+        }
+        catch (...)
+        {
+        }
+        pos = end + 1;
+    }
+    return list;
+}
+
+namespace
+{
+// parse a size such as "512M" (binary units), returns 0 on error
+numa_tools::size_type
+parse_size(std::string const& str)
+{
+    std::size_t           pos = 0;
+    numa_tools::size_type size = 0;
+    try
+    {
+        size = std::stoull(str, &pos);
+    }
+    catch (...)
+    {
+        return 0u;
+    }
+    if (pos == str.size()) return size;
+    if (pos + 1 != str.size()) return 0u;
+    switch (str[pos])
+    {
+        case 'T': size <<= 10; [[fallthrough]];
+        case 'G': size <<= 10; [[fallthrough]];
+        case 'M': size <<= 10; [[fallthrough]];
+        case 'K': size <<= 10; break;
+        default: return 0u;
+    }
+    return size;
+}
+
+// parse a plain count such as "4" (no sign, no unit), returns 0 on error
+std::size_t
+parse_count(std::string const& str)
+{
+    const auto digit = [](char c) { return c >= '0' && c <= '9'; };
+    if (str.empty() || !std::all_of(str.begin(), str.end(), digit)) return 0u;
+    try
+    {
+        return std::stoull(str);
+    }
+    catch (...)
+    {
+        return 0u;
+    }
+}
+
+// number of bytes of an allocation charged to its i-th node
+numa_tools::size_type
+share(numa_tools::size_type size, std::size_t num_nodes, std::size_t i) noexcept
+{
+    return size / num_nodes + (i == 0 ? size % num_nodes : 0u);
+}
+} // namespace
+
+std::unique_ptr<numa_tools::topology>
+numa_tools::topology::load() HWMALLOC_NUMA_CONDITIONAL_NOEXCEPT
+{
+    const char* env = std::getenv("HWMALLOC_NUMA_TOPOLOGY");
+    if (!env || !*env) return {};
+
+    // the variable names a file or holds the statements directly
+    std::string spec;
+    {
+        std::ifstream f(env);
+        if (f)
+        {
+            std::stringstream buffer;
+            buffer << f.rdbuf();
+            spec = buffer.str();
+        }
+        else
+        {
+            spec = env;
+            std::replace(spec.begin(), spec.end(), ';', '\n');
+        }
+    }
+
+    const size_type physical_memory =
+        static_cast<size_type>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE);
+    auto                                   t = std::make_unique<topology>();
+    std::vector<std::array<index_type, 3>> distances;
+    std::istringstream                     lines(spec);
+    std::string                            line;
+    while (std::getline(lines, line))
+    {
+        line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        std::string        statement;
+        if (!(words >> statement)) continue;
+        if (statement == "node")
+        {
+            node_type n;
+            if (!(words >> n.id)) HWMALLOC_TOPOLOGY_ERROR("missing node id in '" + line + "'");
+            if (t->find(n.id)) HWMALLOC_TOPOLOGY_ERROR("node defined twice in '" + line + "'");
+            n.capacity = physical_memory;
+            std::string key, value;
+            while (words >> key)
+            {
+                if (!(words >> value)) HWMALLOC_TOPOLOGY_ERROR("missing value in '" + line + "'");
+                if (key == "cpus") n.cpus = parse_list(value);
+                else if (key == "memory")
+                    n.capacity = parse_size(value);
+                else if (key == "l3")
+                    n.cpus_per_cache_domain = parse_count(value);
+                else if (key == "tier")
+                {
+                    n.has_tier = true;
+                    if (value == "dram") n.tier = memory_tier::dram;
+                    else if (value == "hbm")
+                        n.tier = memory_tier::hbm;
+                    else if (value == "cxl")
+                        n.tier = memory_tier::cxl;
+                    else
+                        HWMALLOC_TOPOLOGY_ERROR("unknown tier in '" + line + "'");
+                }
+                else
+                    HWMALLOC_TOPOLOGY_ERROR("unknown key in '" + line + "'");
+                if ((key == "cpus" && n.cpus.empty()) || (key == "memory" && !n.capacity) ||
+                    (key == "l3" && !n.cpus_per_cache_domain))
+                    HWMALLOC_TOPOLOGY_ERROR("invalid value in '" + line + "'");
+            }
+            t->nodes.push_back(std::move(n));
+            std::sort(t->nodes.begin(), t->nodes.end(),
+                [](auto const& a, auto const& b) { return a.id < b.id; });
+        }
+        else if (statement == "distance")
+        {
+            std::array<index_type, 3> d;
+            if (!(words >> d[0] >> d[1] >> d[2]))
+                HWMALLOC_TOPOLOGY_ERROR("invalid distance in '" + line + "'");
+            distances.push_back(d);
+        }
+        else
+            HWMALLOC_TOPOLOGY_ERROR("unknown statement in '" + line + "'");
+    }
+    if (std::none_of(
+            t->nodes.begin(), t->nodes.end(), [](auto const& n) { return !n.cpus.empty(); }))
+        HWMALLOC_TOPOLOGY_ERROR("no node has cpus");
+
+    t->num_nodes = t->nodes.back().id + 1;
+    t->used.assign(t->num_nodes, 0u);
+    t->distances.assign(t->num_nodes * t->num_nodes, 0);
+    for (auto const& a : t->nodes)
+        for (auto const& b : t->nodes)
+            t->distances[a.id * t->num_nodes + b.id] = (a.id == b.id) ? 10 : 20;
+    for (auto const& d : distances)
+    {
+        if (!t->find(d[0]) || !t->find(d[1]))
+            HWMALLOC_TOPOLOGY_ERROR("distance refers to an unknown node");
+        t->distances[d[0] * t->num_nodes + d[1]] = d[2];
+        t->distances[d[1] * t->num_nodes + d[0]] = d[2];
+    }
+    return t;
+}
+
+numa_tools::topology::node_type const*
+numa_tools::topology::find(index_type id) const noexcept
+{
+    auto it = std::lower_bound(nodes.begin(), nodes.end(), id,
+        [](auto const& n, index_type i) { return n.id < i; });
+    return (it != nodes.end() && it->id == id) ? &(*it) : nullptr;
+}
+
+void
+numa_tools::discover_nearest_nodes(std::vector<index_type> const& memory_nodes) noexcept
+{
+    m_nearest_nodes.assign(m_num_nodes, {});
+    for (auto i : memory_nodes)
+    {
+        auto& nearest = m_nearest_nodes[i];
+        nearest = memory_nodes;
+        // stable sort keeps ascending node ids among equally distant nodes
+        std::stable_sort(nearest.begin(), nearest.end(),
+            [this, i](index_type a, index_type b)
+            {
+                if (a == i || b == i) return a == i && b != i;
+                return distance(i, a) < distance(i, b);
+            });
+    }
+}
+
+// a cpu-less node counts as hbm when it is closer to some cpu than the nearest remote dram node
+numa_tools::memory_tier
+numa_tools::distance_tier(index_type node) const noexcept
+{
+    int remote_distance = 20;
+    for (auto [a, i] : host_nodes())
+        for (auto [b, j] : host_nodes())
+            if (a != b) remote_distance = std::min(remote_distance, distance(a, b));
+
+    int cpu_distance = 255;
+    for (auto [h, j] : host_nodes())
+        if (distance(node, h) > 0) cpu_distance = std::min(cpu_distance, distance(node, h));
+    return (cpu_distance < remote_distance) ? memory_tier::hbm : memory_tier::cxl;
+}
+
+numa_tools::memory_tier
+numa_tools::tier_of(index_type node) const noexcept
+{
+    return node < m_num_nodes ? m_node_tiers[node] : memory_tier::dram;
+}
+
+numa_tools::size_type
+numa_tools::num_cache_domains(index_type node) const noexcept
+{
+    return node < m_num_cache_domains.size() ? m_num_cache_domains[node] : 1u;
+}
+
+int
+numa_tools::distance(index_type a, index_type b) const noexcept
+{
+    return (a < m_num_nodes && b < m_num_nodes) ? m_distances[a * m_num_nodes + b] : 0;
+}
+
+const std::vector<numa_tools::index_type>&
+numa_tools::nearest_nodes(index_type node) const noexcept
+{
+    static const std::vector<index_type> empty;
+    return node < m_num_nodes ? m_nearest_nodes[node] : empty;
+}
+
+// build the node maps, distances and tiers from the simulated topology
+void
+numa_tools::discover_simulated_nodes() noexcept
+{
+    std::vector<index_type> host_nodes_;
+    std::vector<index_type> device_nodes_;
+    std::vector<index_type> memory_nodes;
+    // simulated cpu, node, cache domain
+    std::vector<std::array<index_type, 3>> cpus;
+    m_num_cache_domains.assign(m_topology->num_nodes, 1u);
+    for (auto const& n : m_topology->nodes)
+    {
+        (n.cpus.empty() ? device_nodes_ : host_nodes_).push_back(n.id);
+        memory_nodes.push_back(n.id);
+        const auto domain_size = n.cpus_per_cache_domain ? n.cpus_per_cache_domain : n.cpus.size();
+        for (std::size_t i = 0; i < n.cpus.size(); ++i)
+            cpus.push_back({n.cpus[i], n.id, i / domain_size});
+        if (!n.cpus.empty())
+            m_num_cache_domains[n.id] = (n.cpus.size() + domain_size - 1) / domain_size;
+    }
+    std::sort(cpus.begin(), cpus.end());
+
+    // map the machine's cpus round-robin onto the simulated cpus
+    m_cpu_to_node.resize(std::max(sysconf(_SC_NPROCESSORS_CONF), 1l));
+    m_cpu_to_local_index.resize(m_cpu_to_node.size());
+    m_cpu_to_cache_domain.resize(m_cpu_to_node.size());
+    for (std::size_t cpu = 0; cpu < m_cpu_to_node.size(); ++cpu)
+    {
+        m_cpu_to_node[cpu] = cpus[cpu % cpus.size()][1];
+        m_cpu_to_cache_domain[cpu] = cpus[cpu % cpus.size()][2];
+        m_cpu_to_local_index[cpu] =
+            std::lower_bound(host_nodes_.begin(), host_nodes_.end(), m_cpu_to_node[cpu]) -
+            host_nodes_.begin();
+    }
+
+    m_host_nodes = node_map(host_nodes_);
+    m_local_nodes = node_map(std::move(host_nodes_));
+    m_device_nodes = node_map(std::move(device_nodes_));
+
+    m_num_nodes = m_topology->num_nodes;
+    m_distances = m_topology->distances;
+    discover_nearest_nodes(memory_nodes);
+
+    m_node_tiers.assign(m_num_nodes, memory_tier::dram);
+    for (auto const& n : m_topology->nodes)
+    {
+        if (n.has_tier) m_node_tiers[n.id] = n.tier;
+        else if (n.cpus.empty())
+            m_node_tiers[n.id] = distance_tier(n.id);
+    }
+
+    is_initialized_ = true;
+}
+
+numa_tools::allocation
+numa_tools::allocate_simulated(
+    size_type num_pages, std::vector<index_type> const& nodes, placement p) const noexcept
+{
+    if (num_pages == 0u || nodes.empty()) return {};
+    const auto size = num_pages * page_size_;
+    auto&      t = *m_topology;
+
+    std::lock_guard<std::mutex> lock(t.mutex);
+    auto                        fits = [&t](index_type n, size_type s)
+    {
+        auto node = t.find(n);
+        return node && t.used[n] + s <= node->capacity;
+    };
+
+    // select the nodes the allocation is charged to
+    std::vector<index_type> selected;
+    const auto              node = nodes.front();
+    switch (p)
+    {
+        case placement::interleave:
+            for (std::size_t i = 0; i < nodes.size(); ++i)
+                if (!fits(nodes[i], share(size, nodes.size(), i))) return {};
+            selected = nodes;
+            break;
+        case placement::bind:
+            if (fits(node, size)) selected = {node};
+            break;
+        case placement::preferred:
+        {
+            auto const& candidates =
+                nearest_nodes(node).empty() ? nearest_nodes(local_node()) : nearest_nodes(node);
+            for (auto n : candidates)
+                if (fits(n, size))
+                {
+                    selected = {n};
+                    break;
+                }
+            break;
+        }
+        default:
+            // like numa_alloc_onnode with malloc fallback: memory ends up on the local node
+            selected = {(can_allocate_on(node) && fits(node, size)) ? node : local_node()};
+    }
+    if (selected.empty()) return {};
+
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) return {};
+    for (std::size_t i = 0; i < selected.size(); ++i)
+        t.used[selected[i]] += share(size, selected.size(), i);
+    t.records[(std::uintptr_t)ptr] = topology::record_type{size, selected};
+    HWMALLOC_LOG("allocating", size, "bytes on simulated node", selected.front(), ":",
+        (std::uintptr_t)ptr);
+    return {ptr, size, (p == placement::interleave) ? node : selected.front()};
+}
+
+void
+numa_tools::free_simulated(allocation const& a) const noexcept
+{
+    auto&                       t = *m_topology;
+    std::lock_guard<std::mutex> lock(t.mutex);
+    auto                        it = t.records.find((std::uintptr_t)a.ptr);
+    if (it == t.records.end()) return;
+    auto const& r = it->second;
+    for (std::size_t i = 0; i < r.nodes.size(); ++i)
+        t.used[r.nodes[i]] -= share(r.size, r.nodes.size(), i);
+    HWMALLOC_LOG("freeing   ", r.size, "bytes on simulated node", r.nodes.front(), ":",
+        (std::uintptr_t)a.ptr);
+    munmap(a.ptr, r.size);
+    t.records.erase(it);
+}
+
+bool
+numa_tools::migrate_simulated(allocation const& a, index_type node) const noexcept
+{
+    auto&                       t = *m_topology;
+    std::lock_guard<std::mutex> lock(t.mutex);
+    auto                        it = t.records.find((std::uintptr_t)a.ptr);
+    auto                        n = t.find(node);
+    if (it == t.records.end() || !n) return false;
+    auto& r = it->second;
+    if (r.nodes.size() == 1u && r.nodes.front() == node) return true;
+    if (t.used[node] + r.size > n->capacity) return false;
+    for (std::size_t i = 0; i < r.nodes.size(); ++i)
+        t.used[r.nodes[i]] -= share(r.size, r.nodes.size(), i);
+    t.used[node] += r.size;
+    r.nodes = {node};
+    HWMALLOC_LOG("migrating ", r.size, "bytes to simulated node", node, ":", (std::uintptr_t)a.ptr);
+    return true;
+}
+
+numa_tools::index_type
+numa_tools::get_simulated_node(void* ptr) const noexcept
+{
+    auto&                       t = *m_topology;
+    const auto                  addr = (std::uintptr_t)ptr;
+    std::lock_guard<std::mutex> lock(t.mutex);
+    auto                        it = t.records.upper_bound(addr);
+    if (it != t.records.begin())
+    {
+        --it;
+        if (addr < it->first + it->second.size) return it->second.nodes.front();
+    }
+    return local_node();
+}
+
+numa_tools::size_type
+numa_tools::simulated_free_memory(index_type node) const noexcept
+{
+    auto&                       t = *m_topology;
+    std::lock_guard<std::mutex> lock(t.mutex);
+    auto                        n = t.find(node);
+    return n ? n->capacity - std::min(n->capacity, t.used[node]) : 0u;
+}
+
+} // namespace hwmalloc
@@ -0,0 +1,74 @@
+/*
+ * ghex-org
+ *
+ * Copyright (c) 2014-2023, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <hwmalloc/numa.hpp>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace hwmalloc
+{
+// parse a sysfs style list such as "0-3,8,10-11"
+std::vector<numa_tools::index_type> parse_list(std::string const& str);
+
+// Simulated numa topology, read from the HWMALLOC_NUMA_TOPOLOGY environment variable.
+// The variable holds either the path of a topology file or the topology itself (statements
+// separated by ';'). Each statement is one of
+//
+//     node <id> [cpus <list>] [memory <size>[K|M|G|T]] [tier dram|hbm|cxl] [l3 <n>]
+//     distance <a> <b> <d>
+//
+// where '#' starts a comment. Nodes without cpus are cpu-less memory nodes; their tier defaults to
+// hbm when they are closer to a cpu node than two cpu nodes are to each other, and to cxl
+// otherwise. With l3, the node's cpus are split into last level cache domains of n consecutive cpus
+// each (default: one domain per node). Distances are symmetric and default to 10 (same node) and 20
+// (other nodes). Memory defaults to the physical memory of the machine.
+//
+// The simulated nodes are backed by ordinary anonymous memory. Every allocation is recorded
+// together with the node it was placed on, so that get_node reports the simulated node and the free
+// memory of a node is its capacity minus what has been allocated on it. The machine's cpus are
+// mapped round-robin onto the simulated cpus, and the process may run on all simulated cpus.
+struct numa_tools::topology
+{
+    struct node_type
+    {
+        index_type              id;
+        std::vector<index_type> cpus;
+        size_type               capacity = 0u;
+        size_type               cpus_per_cache_domain = 0u;
+        memory_tier             tier = memory_tier::dram;
+        bool                    has_tier = false;
+    };
+
+    struct record_type
+    {
+        size_type               size;
+        std::vector<index_type> nodes;
+    };
+
+    std::vector<node_type> nodes; // sorted by id
+    index_type             num_nodes = 0;
+    std::vector<int>       distances;
+    std::vector<size_type> used;
+    // start address -> allocation record
+    std::map<std::uintptr_t, record_type> records;
+    std::mutex                            mutex;
+
+    // returns nullptr if the environment variable is not set
+    static std::unique_ptr<topology> load() HWMALLOC_NUMA_CONDITIONAL_NOEXCEPT;
+
+    node_type const* find(index_type id) const noexcept;
+};
+
+} // namespace hwmalloc
@@ -0,0 +1,213 @@
+/*
+ * ghex-org
+ *
+ * Copyright (c) 2014-2023, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <hwmalloc/trace.hpp>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <new>
+#include <ostream>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef HWMALLOC_TRACE_BUFFER_SIZE
+#define HWMALLOC_TRACE_BUFFER_SIZE 16384
+#endif
+
+namespace hwmalloc
+{
+namespace trace
+{
+namespace
+{
+constexpr std::uint64_t buffer_size = HWMALLOC_TRACE_BUFFER_SIZE;
+static_assert((buffer_size & (buffer_size - 1)) == 0, "trace buffer size must be a power of 2");
+
+// single-producer ring buffer owned by one thread
+// buffers are linked into a global list and outlive their threads, so that events of joined threads
+// can still be dumped; the buffer of an exited thread is reused by the next new thread
+struct buffer
+{
+    std::atomic<std::uint64_t> m_head{0};
+    std::atomic<bool>          m_in_use{true};
+    long                       m_tid;
+    buffer*                    m_next = nullptr;
+    record_type                m_records[buffer_size];
+};
+
+// a thread's buffer, given back when the thread exits
+struct thread_state
+{
+    buffer* m_buffer = nullptr;
+
+    ~thread_state()
+    {
+        if (m_buffer) m_buffer->m_in_use.store(false, std::memory_order_release);
+        m_buffer = nullptr;
+    }
+};
+
+std::atomic<buffer*> buffers_{nullptr}; // never shrinks, buffers are reused
+
+buffer*
+acquire_buffer() noexcept
+{
+    const long tid = ::syscall(SYS_gettid);
+    for (auto b = buffers_.load(std::memory_order_acquire); b; b = b->m_next)
+    {
+        bool in_use = false;
+        if (!b->m_in_use.load(std::memory_order_relaxed) &&
+            b->m_in_use.compare_exchange_strong(in_use, true, std::memory_order_acquire))
+        {
+            // the events of the previous thread are dropped
+            b->m_head.store(0, std::memory_order_relaxed);
+            b->m_tid = tid;
+            return b;
+        }
+    }
+    auto b = new (std::nothrow) buffer;
+    if (!b) return nullptr;
+    b->m_tid = tid;
+    // lock-free push onto global list
+    b->m_next = buffers_.load(std::memory_order_relaxed);
+    while (!buffers_.compare_exchange_weak(b->m_next, b, std::memory_order_release,
+        std::memory_order_relaxed)) {}
+    return b;
+}
+
+// nullptr if no buffer can be allocated
+buffer*
+thread_buffer() noexcept
+{
+    static thread_local thread_state s;
+    if (!s.m_buffer) s.m_buffer = acquire_buffer();
+    return s.m_buffer;
+}
+
+char const*
+event_name(event e) noexcept
+{
+    switch (e)
+    {
+        case event::segment_add: return "segment_add";
+        case event::segment_remove: return "segment_remove";
+        case event::register_begin:
+        case event::register_end: return "register";
+        case event::slow_path_begin:
+        case event::slow_path_end: return "slow_path";
+        case event::trim: return "trim";
+        case event::budget: return "budget";
+        case event::fallback: return "fallback";
+        case event::migrate: return "migrate";
+    }
+    return "unknown";
+}
+
+char
+event_phase(event e) noexcept
+{
+    switch (e)
+    {
+        case event::register_begin:
+        case event::slow_path_begin: return 'B';
+        case event::register_end:
+        case event::slow_path_end: return 'E';
+        default: return 'i';
+    }
+}
+
+void
+write_args(std::ostream& os, record_type const& r)
+{
+    switch (r.kind)
+    {
+        case event::segment_add:
+        case event::segment_remove:
+        case event::register_begin:
+        case event::register_end:
+            os << "{\"ptr\":\"0x" << std::hex << r.arg0 << std::dec << "\",\"size\":" << r.arg1
+               << "}";
+            break;
+        case event::trim:
+            os << "{\"block_size\":" << r.arg0 << ",\"segments\":" << r.arg1 << "}";
+            break;
+        case event::migrate:
+            os << "{\"ptr\":\"0x" << std::hex << r.arg0 << std::dec << "\",\"numa_node\":"
+               << r.arg1 << "}";
+            break;
+        default: os << "{\"block_size\":" << r.arg0 << ",\"numa_node\":" << r.arg1 << "}";
+    }
+}
+} // namespace
+
+std::uint64_t
+now() noexcept
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void
+record(event e, std::uint64_t arg0, std::uint64_t arg1) noexcept
+{
+    auto b = thread_buffer();
+    if (!b) return;
+    auto const h = b->m_head.load(std::memory_order_relaxed);
+    b->m_records[h & (buffer_size - 1)] = record_type{now(), e, 0u, arg0, arg1};
+    b->m_head.store(h + 1, std::memory_order_release);
+}
+
+void
+clear() noexcept
+{
+    for (auto b = buffers_.load(std::memory_order_acquire); b; b = b->m_next)
+        b->m_head.store(0, std::memory_order_relaxed);
+}
+
+void
+write_chrome_trace(std::ostream& os)
+{
+    const auto pid = ::getpid();
+    bool       first = true;
+    os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    for (auto b = buffers_.load(std::memory_order_acquire); b; b = b->m_next)
+    {
+        const auto head = b->m_head.load(std::memory_order_acquire);
+        const auto tail = head > buffer_size ? head - buffer_size : 0;
+        for (auto i = tail; i < head; ++i)
+        {
+            auto const& r = b->m_records[i & (buffer_size - 1)];
+            const auto  ph = event_phase(r.kind);
+            os << (first ? "\n" : ",\n") << "{\"name\":\"" << event_name(r.kind)
+               << "\",\"cat\":\"hwmalloc\",\"ph\":\"" << ph << "\",\"pid\":" << pid
+               << ",\"tid\":" << b->m_tid << ",\"ts\":" << r.timestamp / 1000 << "."
+               << (r.timestamp % 1000) / 100 << (r.timestamp % 100) / 10 << r.timestamp % 10;
+            if (ph == 'i') os << ",\"s\":\"t\"";
+            os << ",\"args\":";
+            write_args(os, r);
+            os << "}";
+            first = false;
+        }
+    }
+    os << "\n]}\n";
+}
+
+bool
+write_chrome_trace(char const* filename)
+{
+    std::ofstream f(filename);
+    if (!f) return false;
+    write_chrome_trace(f);
+    return static_cast<bool>(f);
+}
+
+} // namespace trace
+} // namespace hwmalloc
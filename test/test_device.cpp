@@ -79,3 +79,21 @@ TEST(heap, construction)
     std::cout << ptr.device_ptr() << std::endl;
     h.free(ptr);
 }
+
+TEST(heap, span)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+    context c;
+
+    heap_t h(&c);
+
+    auto p = static_cast<heap_t::typed_pointer<int>>(h.allocate(400, 0, 0));
+    heap_t::span<int> s(p, 100);
+    auto              t = s.subspan(10, 20);
+    EXPECT_TRUE(t.on_device());
+    EXPECT_EQ(t.device_data(), p.device_ptr() + 10);
+    EXPECT_EQ(t.handle().ptr, p.get() + 10);
+    (void)t.device_handle();
+    p.release();
+}
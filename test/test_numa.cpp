@@ -32,6 +32,15 @@ TEST(numa, discover)
     std::cout << "can allocate on 0: " << numa().can_allocate_on(0) << std::endl;
     std::cout << "can allocate on 1: " << numa().can_allocate_on(1) << std::endl;
     std::cout << "can allocate on 2: " << numa().can_allocate_on(2) << std::endl;
+
+    // cached local node must agree with the local node map
+    auto it = numa().local_nodes().find(numa().local_node());
+    EXPECT_TRUE(it != numa().local_nodes().end());
+    EXPECT_EQ(it->second, numa().local_node_index());
+
+    std::cout << "cache domains of local node: " << numa().num_cache_domains(numa().local_node())
+              << std::endl;
+    EXPECT_LT(numa().cache_domain(), numa().num_cache_domains(numa().local_node()));
 }
 
 TEST(numa, allocate)
@@ -75,3 +84,81 @@ TEST(numa, allocate)
     EXPECT_FALSE(d);             // not a valid allocation
     numa().free(d);              // should succeed
 }
+
+TEST(numa, placement)
+{
+    using namespace hwmalloc;
+    using placement = numa_tools::placement;
+
+    const auto node = numa().local_nodes().begin()->first;
+
+    auto a = numa().allocate(4, node, placement::bind);
+    EXPECT_TRUE(a);
+    EXPECT_EQ(a.node, node);
+    EXPECT_TRUE(a.use_numa_free);
+    new (a.ptr) int(42);
+    EXPECT_EQ(numa().get_node(a.ptr), node);
+    numa().free(a);
+
+    auto b = numa().allocate(1, 10000, placement::bind); // strict: impossible node fails
+    EXPECT_FALSE(b);
+
+    auto c = numa().allocate(1, node, placement::preferred);
+    EXPECT_TRUE(c);
+    EXPECT_EQ(c.node, node);
+    numa().free(c);
+
+    auto d = numa().allocate_interleaved(8, {node});
+    EXPECT_TRUE(d);
+    EXPECT_EQ(d.node, node);
+    numa().free(d);
+
+    auto e = numa().allocate(8, node, placement::interleave);
+    EXPECT_TRUE(e);
+    EXPECT_EQ(e.node, node);
+    numa().free(e);
+}
+
+TEST(numa, migrate)
+{
+    using namespace hwmalloc;
+
+    const auto node = numa().local_nodes().rbegin()->first;
+
+    auto a = numa().allocate(4, numa().local_nodes().begin()->first, numa_tools::placement::bind);
+    ASSERT_TRUE(a);
+    new (a.ptr) int(42);
+    EXPECT_TRUE(numa().migrate(a, node));
+    EXPECT_EQ(numa().get_node(a.ptr), node);
+    EXPECT_EQ(*static_cast<int*>(a.ptr), 42);
+    EXPECT_FALSE(numa().migrate(a, 10000));
+    numa().free(a);
+}
+
+TEST(numa, distance)
+{
+    using namespace hwmalloc;
+
+    for (auto [n, i] : numa().host_nodes())
+    {
+        EXPECT_EQ(numa().distance(n, n), 10);
+        auto const& nearest = numa().nearest_nodes(n);
+        EXPECT_FALSE(nearest.empty());
+        EXPECT_EQ(nearest.front(), n);
+        for (std::size_t k = 2; k < nearest.size(); ++k)
+            EXPECT_LE(numa().distance(n, nearest[k - 1]), numa().distance(n, nearest[k]));
+        EXPECT_GT(numa().free_memory(n), 0u);
+    }
+    EXPECT_TRUE(numa().nearest_nodes(10000).empty());
+    EXPECT_EQ(numa().distance(0, 10000), 0);
+}
+
+TEST(numa, tiers)
+{
+    using namespace hwmalloc;
+
+    for (auto [n, i] : numa().host_nodes())
+        EXPECT_EQ(numa().tier_of(n), numa_tools::memory_tier::dram);
+    for (auto [n, i] : numa().device_nodes())
+        EXPECT_NE(numa().tier_of(n), numa_tools::memory_tier::dram);
+}
@@ -14,7 +14,18 @@
 #include <hwmalloc/detail/fixed_size_heap.hpp>
 #include <hwmalloc/heap.hpp>
 
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <mutex>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 struct context
 {
@@ -71,16 +82,18 @@ TEST(segment, construction)
     auto a = hwmalloc::numa().allocate(1, 0);
     auto r = hwmalloc::register_memory(c, a.ptr, a.size);
 
-    boost::lockfree::stack<block_t> free_stack(256);
+    segment_t::free_list_type::table_type table(a.size / sizeof(int));
+    segment_t::free_list_type             free_stack(table);
 
     segment_t s(nullptr, std::move(r), a, sizeof(int), free_stack);
 
     while (true)
     {
-        block_t x;
-        if (!free_stack.pop(x)) break;
+        std::uint32_t id;
+        if (!free_stack.pop(id)) break;
         else
         {
+            block_t x = table.segment(id)->make_block(table.index(id));
             std::cout << x.m_ptr << std::endl;
             //x.release();
             x.m_segment->free(x);
@@ -91,6 +104,93 @@ TEST(segment, construction)
     s.collect(free_stack);
 }
 
+TEST(segment, free_list)
+{
+    using segment_t = hwmalloc::detail::segment<context>;
+    using block_t = segment_t::block;
+
+    context c;
+
+    auto a = hwmalloc::numa().allocate(1, 0);
+    auto r = hwmalloc::register_memory(c, a.ptr, a.size);
+
+    const std::size_t                     n = a.size / 64;
+    segment_t::free_list_type::table_type table(n);
+    segment_t::free_list_type             free_stack(table);
+
+    segment_t s(nullptr, std::move(r), a, 64, free_stack);
+
+    // blocks are handed out in address order
+    std::vector<block_t> blocks;
+    for (std::uint32_t id; free_stack.pop(id);)
+        blocks.push_back(table.segment(id)->make_block(table.index(id)));
+    ASSERT_EQ(blocks.size(), n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        EXPECT_EQ(blocks[i].m_ptr, (char*)a.ptr + i * 64);
+        EXPECT_EQ(blocks[i].m_handle.ptr, blocks[i].m_ptr);
+    }
+
+    // single and batched frees are collected together
+    s.free(blocks[0]);
+    s.free(blocks.begin() + 1, blocks.end());
+    EXPECT_TRUE(s.is_empty());
+    EXPECT_EQ(s.collect(free_stack), n);
+    EXPECT_FALSE(s.is_empty());
+    EXPECT_EQ(s.collect(free_stack), 0u);
+
+    std::size_t m = 0;
+    for (std::uint32_t id; free_stack.pop(id); ++m) EXPECT_EQ(table.segment(id), &s);
+    EXPECT_EQ(m, n);
+}
+
+TEST(segment, bitmap)
+{
+    using segment_t = hwmalloc::detail::segment<context>;
+    using block_t = segment_t::block;
+
+    context c;
+
+    auto a = hwmalloc::numa().allocate(1, 0);
+    auto r = hwmalloc::register_memory(c, a.ptr, a.size);
+
+    // a table without links selects the bitmap engine
+    const std::size_t                     n = a.size / 32;
+    segment_t::free_list_type::table_type table(n, false);
+    segment_t::free_list_type             free_stack(table);
+
+    segment_t s(nullptr, std::move(r), a, 32, free_stack);
+    EXPECT_TRUE(free_stack.empty());
+    EXPECT_TRUE(s.is_empty());
+
+    // blocks are taken in address order
+    std::vector<block_t> blocks;
+    for (std::size_t i; s.take_free(i);) blocks.push_back(s.make_block(i));
+    ASSERT_EQ(blocks.size(), n);
+    for (std::size_t i = 0; i < n; ++i) EXPECT_EQ(blocks[i].m_ptr, (char*)a.ptr + i * 32);
+    EXPECT_EQ(s.num_freed(), 0u);
+
+    // the lowest freed block is taken first
+    s.free(blocks[100]);
+    s.free(blocks[7]);
+    EXPECT_EQ(s.num_freed(), 2u);
+    std::size_t i;
+    EXPECT_TRUE(s.take_free(i));
+    EXPECT_EQ(i, 7u);
+    EXPECT_TRUE(s.take_free(i));
+    EXPECT_EQ(i, 100u);
+
+    // a segment with blocks in use cannot be retired, a retired segment hands out no blocks
+    s.free(blocks.begin() + 1, blocks.end());
+    EXPECT_FALSE(s.retire());
+    EXPECT_FALSE(s.is_retired());
+    s.free(blocks[0]);
+    EXPECT_TRUE(s.is_empty());
+    EXPECT_TRUE(s.retire());
+    EXPECT_FALSE(s.take_free(i));
+    EXPECT_TRUE(s.is_empty());
+}
+
 TEST(pool, construction)
 {
     using pool_t = hwmalloc::detail::pool<context>;
@@ -114,6 +214,170 @@ TEST(pool, construction)
     }
 }
 
+TEST(pool, fullest_segment_first)
+{
+    using pool_t = hwmalloc::detail::pool<context>;
+    using block_t = pool_t::block_type;
+
+    context c;
+
+    hwmalloc::heap_config config;
+    config.cache_domain_shards = false;
+    pool_t     p(&c, 64, hwmalloc::numa().page_size(), 0, config);
+    const auto n = hwmalloc::numa().page_size() / 64;
+
+    // two full segments
+    std::vector<block_t> blocks;
+    for (std::size_t i = 0; i < 2 * n; ++i) blocks.push_back(p.allocate());
+    EXPECT_EQ(p.num_segments(), 2u);
+    auto a = blocks[0].m_segment;
+    auto b = blocks[n].m_segment;
+    ASSERT_NE(a, b);
+
+    // a keeps one block, b keeps most of its blocks
+    for (std::size_t i = 1; i < n; ++i) p.free(blocks[i]);
+    for (std::size_t i = n; i < n + n / 4; ++i) p.free(blocks[i]);
+
+    // new blocks are taken from the fuller segment b, so that a can drain
+    for (std::size_t i = n; i < n + n / 4; ++i)
+    {
+        blocks[i] = p.allocate();
+        EXPECT_EQ(blocks[i].m_segment, b);
+    }
+    p.free(blocks[0]);
+    EXPECT_EQ(p.num_segments(), 1u);
+
+    for (std::size_t i = n; i < 2 * n; ++i) p.free(blocks[i]);
+}
+
+TEST(pool, elimination)
+{
+    using pool_t = hwmalloc::detail::pool<context>;
+
+    context c;
+
+    hwmalloc::heap_config config;
+    config.elimination_slots = 4;
+    pool_t p(&c, 64, hwmalloc::numa().page_size(), 0, config);
+
+    // blocks handed over by elimination are never owned by two threads at once
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back(
+            [&p, t]()
+            {
+                for (int i = 0; i < 20000; ++i)
+                {
+                    auto b = p.allocate();
+                    *static_cast<int volatile*>(b.m_ptr) = t;
+                    std::this_thread::yield();
+                    EXPECT_EQ(*static_cast<int volatile*>(b.m_ptr), t);
+                    p.free(b);
+                }
+            });
+    for (auto& t : threads) t.join();
+}
+
+TEST(pool, bitmap)
+{
+    using pool_t = hwmalloc::detail::pool<context>;
+    using block_t = pool_t::block_type;
+
+    context c;
+
+    hwmalloc::heap_config config;
+    config.bitmap_tiny_classes = true;
+    config.cache_domain_shards = false;
+    pool_t     p(&c, 16, hwmalloc::numa().page_size(), 0, config);
+    const auto n = hwmalloc::numa().page_size() / 16;
+
+    // blocks are handed out in address order, segment by segment
+    std::vector<block_t> blocks;
+    for (std::size_t i = 0; i < 2 * n; ++i) blocks.push_back(p.allocate());
+    EXPECT_EQ(p.num_segments(), 2u);
+    for (std::size_t i = 1; i < n; ++i)
+        EXPECT_EQ((char*)blocks[i].m_ptr, (char*)blocks[0].m_ptr + i * 16);
+
+    // the emptied segment is released, the freed blocks are reused lowest first
+    for (std::size_t i = n; i < 2 * n; ++i) p.free(blocks[i]);
+    EXPECT_EQ(p.num_segments(), 1u);
+    p.free(blocks[5]);
+    p.free(blocks[3]);
+    EXPECT_EQ(p.allocate().m_ptr, blocks[3].m_ptr);
+    EXPECT_EQ(p.allocate().m_ptr, blocks[5].m_ptr);
+    for (std::size_t i = 0; i < n; ++i) p.free(blocks[i]);
+
+    // concurrent allocations never hand out a block twice
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back(
+            [&p, t, n]()
+            {
+                std::vector<block_t> mine;
+                for (int i = 0; i < 200; ++i)
+                {
+                    for (std::size_t k = 0; k < n / 2; ++k)
+                    {
+                        mine.push_back(p.allocate());
+                        *static_cast<int volatile*>(mine.back().m_ptr) = t;
+                    }
+                    std::this_thread::yield();
+                    for (auto& b : mine)
+                    {
+                        EXPECT_EQ(*static_cast<int volatile*>(b.m_ptr), t);
+                        p.free(b);
+                    }
+                    mine.clear();
+                }
+            });
+    for (auto& t : threads) t.join();
+    EXPECT_EQ(p.num_segments(), 1u);
+}
+
+// context which needs buffers aligned to 1 KiB
+struct aligned_context : context
+{
+};
+
+std::size_t
+required_alignment(aligned_context const&)
+{
+    return 1024;
+}
+
+TEST(pool, cache_colors)
+{
+    context         c;
+    aligned_context ac;
+
+    hwmalloc::heap_config config;
+    config.cache_colors = 4;
+    config.num_reserve_segments = 8;
+
+    const std::size_t n = 8;
+    {
+        // successive segments are shifted by one cache line
+        hwmalloc::detail::pool<context> p(&c, 4096, 4096, 0, config);
+        std::vector<hwmalloc::detail::pool<context>::block_type> blocks;
+        for (std::size_t i = 0; i < n; ++i) blocks.push_back(p.allocate());
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            EXPECT_EQ((std::uintptr_t)blocks[i].m_ptr % 4096, (i % 4) * 64);
+            EXPECT_EQ(blocks[i].m_handle.ptr, blocks[i].m_ptr);
+        }
+        for (auto& b : blocks) p.free(b);
+    }
+    {
+        // by the context's alignment
+        hwmalloc::detail::pool<aligned_context> p(&ac, 4096, 4096, 0, config);
+        std::vector<hwmalloc::detail::pool<aligned_context>::block_type> blocks;
+        for (std::size_t i = 0; i < n; ++i) blocks.push_back(p.allocate());
+        for (std::size_t i = 0; i < n; ++i)
+            EXPECT_EQ((std::uintptr_t)blocks[i].m_ptr % 4096, (i % 4) * 1024);
+        for (auto& b : blocks) p.free(b);
+    }
+}
+
 TEST(fixed_size_heap, construction)
 {
     using heap_t = hwmalloc::detail::fixed_size_heap<context>;
@@ -158,6 +422,159 @@ TEST(heap, construction)
     }
 }
 
+TEST(heap, size_classes)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+    context c;
+
+    heap_t h(&c);
+
+    // consecutive blocks of a fresh size class are adjacent: their distance is the block size
+    for (std::size_t n : {1u, 8u, 9u, 100u, 128u, 129u, 200u, 256u, 257u, 1000u, 1024u, 1025u})
+    {
+        const std::size_t block =
+            n <= 128u ? (n + 7u) / 8u * 8u : std::size_t(1) << (64 - __builtin_clzll(n - 1));
+        auto a = h.allocate(n, 0);
+        auto b = h.allocate(n, 0);
+        EXPECT_EQ((char*)b.get() - (char*)a.get(), (std::ptrdiff_t)block);
+        h.free(a);
+        h.free(b);
+    }
+}
+
+TEST(heap, static_size_class)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+    context c;
+
+    heap_t h(&c);
+
+    // sizes known at compile time end up in the same size classes
+    auto a = h.allocate<24>(0);
+    auto b = h.allocate(24, 0);
+    EXPECT_EQ((char*)b.get() - (char*)a.get(), 24);
+    auto d = h.allocate<24>();
+    EXPECT_TRUE(d);
+    auto e = h.allocate<(1u << 20)>(0);
+    EXPECT_TRUE(e);
+    for (auto p : {a, b, d, e}) h.free(p);
+
+    struct message
+    {
+        double x[5];
+    };
+    auto m = h.make_unique<message>(0, message{{1., 2., 3., 4., 5.}});
+    EXPECT_EQ(m->x[4], 5.);
+}
+
+TEST(heap, reallocate)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+    context c;
+
+    heap_t h(&c);
+
+    // a null pointer is allocated
+    auto p = h.reallocate(nullptr, 20);
+    ASSERT_TRUE(p);
+    std::memset(p.get(), 7, 20);
+
+    // growing within the size class keeps the block
+    EXPECT_EQ(h.reallocate(p, 24), p);
+    EXPECT_EQ(h.reallocate(p, 1), p);
+
+    // growing beyond it copies the contents
+    for (std::size_t n : {100u, 1000u, 100000u, 1000000u})
+    {
+        auto q = h.reallocate(p, n);
+        EXPECT_NE(q, p);
+        for (int i = 0; i < 20; ++i) EXPECT_EQ(static_cast<char*>(q.get())[i], 7);
+        p = q;
+    }
+    h.free(p);
+
+    // user allocations cannot be resized
+    std::vector<char> data(100);
+    auto              u = h.register_user_allocation(data.data(), data.size());
+    EXPECT_THROW(h.reallocate(u, 200), std::invalid_argument);
+    h.free(u);
+}
+
+TEST(heap, local_allocation)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+    context c;
+
+    heap_t h(&c);
+
+    auto ptr = h.allocate(100);
+    EXPECT_TRUE(ptr);
+    EXPECT_TRUE(hwmalloc::numa().can_allocate_on(hwmalloc::numa().local_node()));
+    h.free(ptr);
+}
+
+TEST(heap, placement)
+{
+    using heap_t = hwmalloc::heap<context>;
+    using placement = hwmalloc::numa_tools::placement;
+
+    context c;
+
+    for (auto p : {placement::bind, placement::preferred, placement::interleave})
+    {
+        hwmalloc::heap_config config;
+        config.numa_placement = p;
+        heap_t h(&c, config);
+
+        auto ptr = h.allocate(100, 0);
+        EXPECT_TRUE(ptr);
+        h.free(ptr);
+        ptr = h.allocate(1 << 20, 0);
+        EXPECT_TRUE(ptr);
+        h.free(ptr);
+    }
+}
+
+TEST(heap, numa_fallback)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+    context c;
+
+    hwmalloc::heap_config config;
+    config.numa_placement = hwmalloc::numa_tools::placement::bind;
+    config.numa_fallback = true;
+    heap_t h(&c, config);
+
+    // the local node has enough memory: no fallback
+    auto ptr = h.allocate(1 << 20, hwmalloc::numa().local_node());
+    EXPECT_TRUE(ptr);
+    EXPECT_EQ(std::as_const(h).num_fallback_segments(), 0u);
+    h.free(ptr);
+}
+
+TEST(heap, memory_tier)
+{
+    using heap_t = hwmalloc::heap<context>;
+    using tier = hwmalloc::numa_tools::memory_tier;
+
+    context c;
+
+    heap_t h(&c);
+
+    // without hbm/cxl nodes the allocations spill to dram
+    for (auto t : {tier::dram, tier::hbm, tier::cxl})
+    {
+        auto ptr = h.allocate(100, 0, t);
+        EXPECT_TRUE(ptr);
+        h.free(ptr);
+    }
+}
+
 TEST(heap, allocator)
 {
     using heap_t = hwmalloc::heap<context>;
@@ -171,6 +588,364 @@ TEST(heap, allocator)
     vec.resize(500);
 }
 
+TEST(heap, aligned_allocation)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+    context c;
+
+    // cache colored classes only guarantee cache line alignment on their own
+    hwmalloc::heap_config config;
+    config.cache_colors = 4;
+    heap_t h(&c, config);
+
+    const std::size_t page = hwmalloc::numa().page_size();
+    for (std::size_t a : {1ul, 16ul, 64ul, 256ul, 4096ul})
+    {
+        if (a > page) continue;
+        for (std::size_t n : {1ul, 24ul, 100ul, 3000ul, 5000ul, 200000ul})
+        {
+            std::vector<heap_t::pointer> ptrs;
+            for (int i = 0; i < 8; ++i)
+            {
+                ptrs.push_back(h.allocate(n, std::align_val_t(a), 0));
+                EXPECT_EQ((std::uintptr_t)ptrs.back().get() % a, 0u);
+            }
+            for (auto& p : ptrs) h.free(p);
+        }
+    }
+    EXPECT_THROW(h.allocate(8, std::align_val_t(24), 0), std::invalid_argument);
+    EXPECT_THROW(h.allocate(8, std::align_val_t(2 * page), 0), std::invalid_argument);
+
+    // the STL allocator takes a minimum alignment
+    std::vector<double, heap_t::allocator_type<double>> vec(
+        h.template get_allocator<double>(0, 256));
+    for (int i = 0; i < 100; ++i)
+    {
+        vec.push_back(i);
+        EXPECT_EQ((std::uintptr_t)vec.data() % 256, 0u);
+    }
+}
+
+struct request
+{
+    static inline std::atomic<int> num_constructed = 0;
+    static inline std::atomic<int> num_destroyed = 0;
+
+    int              id;
+    std::vector<int> payload;
+
+    request(int i)
+    : id{i}
+    , payload(16)
+    {
+        ++num_constructed;
+    }
+    ~request() { ++num_destroyed; }
+};
+
+TEST(heap, object_pool)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+    context c;
+
+    heap_t h(&c);
+    {
+        heap_t::object_pool<request> pool(h, 0, [](request& r) { r.id = -1; }, 4);
+
+        // given back objects are reused without being constructed again
+        request* raw;
+        {
+            auto r = pool.get(1);
+            EXPECT_EQ(r->id, 1);
+            raw = &*r;
+        }
+        EXPECT_EQ(request::num_destroyed, 0);
+        {
+            auto r = pool.get(2);
+            EXPECT_EQ(&*r, raw);
+            EXPECT_EQ(r->id, -1);
+            EXPECT_EQ(r->payload.size(), 16u);
+        }
+        EXPECT_EQ(request::num_constructed, 1);
+
+        // overflowing caches are shared with other threads
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+            threads.emplace_back(
+                [&pool, t]()
+                {
+                    for (int i = 0; i < 100; ++i)
+                    {
+                        std::vector<heap_t::object_pool<request>::unique_ptr> v;
+                        for (int k = 0; k < 10; ++k) v.push_back(pool.get(t));
+                        for (auto& r : v) r->id = t;
+                        for (auto& r : v) EXPECT_EQ(r->id, t);
+                    }
+                });
+        for (auto& t : threads) t.join();
+        // at most the objects in use and in the caches of all threads
+        EXPECT_LE(request::num_constructed, 1 + 4 * (10 + 4));
+    }
+    // all objects are destroyed with the pool
+    EXPECT_EQ(request::num_destroyed, request::num_constructed);
+
+    // including those cached by threads which outlive the pool (and the heap)
+    {
+        std::mutex              mutex;
+        std::condition_variable cv;
+        int                     stage = 0;
+        auto                    wait_for = [&](int s)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return stage >= s; });
+        };
+        auto next = [&]()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++stage;
+            cv.notify_all();
+        };
+        std::thread worker;
+        {
+            heap_t                       h2(&c);
+            heap_t::object_pool<request> pool(h2, 0, {}, 4);
+            worker = std::thread(
+                [&]()
+                {
+                    {
+                        auto r = pool.get(1);
+                        auto s = pool.get(2);
+                    }
+                    next();
+                    wait_for(2);
+                });
+            wait_for(1);
+            EXPECT_NE(request::num_destroyed, request::num_constructed);
+        }
+        EXPECT_EQ(request::num_destroyed, request::num_constructed);
+        next();
+        worker.join();
+    }
+
+    // objects whose reset hook throws are destroyed instead of cached
+    {
+        heap_t::object_pool<request> pool(
+            h, 0,
+            [](request& r)
+            {
+                if (r.id < 0) throw std::runtime_error("reset");
+            },
+            4);
+        const int destroyed = request::num_destroyed;
+        pool.get(-1);
+        EXPECT_EQ(request::num_destroyed, destroyed + 1);
+        pool.get(1);
+        EXPECT_EQ(request::num_destroyed, destroyed + 1);
+    }
+    EXPECT_EQ(request::num_destroyed, request::num_constructed);
+}
+
+TEST(heap, arena)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+    context c;
+
+    heap_t h(&c);
+
+    heap_t::arena a(h, 4096, 0);
+    std::vector<void*> first;
+    for (int epoch = 0; epoch < 3; ++epoch)
+    {
+        std::vector<void*> ptrs;
+        for (std::size_t n : {1u, 100u, 24u, 1000u, 3000u, 10000u, 7u})
+        {
+            auto p = a.allocate(n, 64);
+            EXPECT_EQ((std::uintptr_t)p.get() % 64, 0u);
+            // handles refer to the buffer, not to the arena's block
+            EXPECT_EQ(p.handle().ptr, p.get());
+            std::memset(p.get(), epoch, n);
+            ptrs.push_back(p.get());
+            // no effect
+            h.free(p);
+        }
+        // buffers do not overlap
+        std::vector<void*> sorted = ptrs;
+        std::sort(sorted.begin(), sorted.end());
+        EXPECT_EQ(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+        // the same memory is used again after a reset
+        if (epoch == 0) first = ptrs;
+        else
+            EXPECT_EQ(ptrs, first);
+        a.reset();
+    }
+    EXPECT_GE(a.capacity(), 10000u + 4096u);
+}
+
+TEST(heap, memory_resource)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+    context c;
+
+    heap_t h(&c);
+
+    // raw pointer lookup
+    auto p = h.allocate(100, 0);
+    EXPECT_EQ(heap_t::get_pointer(p.get()), p);
+    EXPECT_FALSE(heap_t::get_pointer((char*)p.get() + 8));
+    int x;
+    EXPECT_FALSE(heap_t::get_pointer(&x));
+    h.free(p);
+
+    heap_t::memory_resource r(h, 0);
+    {
+        std::pmr::vector<int> v(&r);
+        for (int i = 0; i < 100000; ++i) v.push_back(i);
+        EXPECT_EQ(v[99999], 99999);
+        EXPECT_TRUE(heap_t::get_pointer(v.data()));
+
+        std::pmr::list<std::pmr::string> l(&r);
+        for (int i = 0; i < 1000; ++i) l.emplace_back(100, 'a' + i % 26);
+        EXPECT_EQ(l.back().size(), 100u);
+    }
+    auto q = r.allocate(256, 256);
+    EXPECT_EQ((std::uintptr_t)q % 256, 0u);
+    r.deallocate(q, 256, 256);
+    heap_t::memory_resource r2(h, 0);
+    EXPECT_TRUE(r.is_equal(r2));
+
+    heap_t::monotonic_memory_resource m(h, 4096, 0);
+    void* first = nullptr;
+    for (int epoch = 0; epoch < 2; ++epoch)
+    {
+        {
+            std::pmr::vector<double> v(&m);
+            for (int i = 0; i < 1000; ++i) v.push_back(i);
+            std::pmr::unsynchronized_pool_resource pooled(&m);
+            std::pmr::list<int>                    l(&pooled);
+            for (int i = 0; i < 1000; ++i) l.push_back(i);
+            EXPECT_EQ(l.size(), 1000u);
+            void* a = m.allocate(8, 8);
+            if (epoch == 0) first = a;
+            else
+                EXPECT_EQ(a, first);
+        }
+        // only once nothing refers to the memory any more
+        m.release();
+    }
+    EXPECT_FALSE(m.is_equal(r));
+}
+
+TEST(heap, local_allocator)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+    context c;
+
+    heap_t h(&c);
+    heap_t h2(&c);
+    heap_t::registry::set_global(&h);
+
+    {
+        std::list<int, heap_t::local_allocator_type<int>> l;
+        for (int i = 0; i < 1000; ++i) l.push_back(i);
+        EXPECT_EQ(l.back(), 999);
+
+        using value_t = std::pair<const int, double>;
+        std::map<int, double, std::less<int>, heap_t::local_allocator_type<value_t>> m;
+        std::unordered_map<int, double, std::hash<int>, std::equal_to<int>,
+            heap_t::local_allocator_type<value_t>>
+            u;
+        for (int i = 0; i < 1000; ++i)
+        {
+            m[i] = i;
+            u[i] = i;
+        }
+        EXPECT_EQ(m.size(), 1000u);
+        EXPECT_EQ(u.at(500), 500.0);
+
+        // over-aligned values
+        struct alignas(128) wide
+        {
+            char x;
+        };
+        std::vector<wide, heap_t::local_allocator_type<wide>> v(10);
+        EXPECT_EQ((std::uintptr_t)v.data() % 128, 0u);
+        EXPECT_TRUE(heap_t::get_pointer(v.data()));
+
+        // nodes allocated by another thread with its own heap are freed here
+        std::thread t(
+            [&]()
+            {
+                heap_t::registry::set_local(&h2);
+                EXPECT_EQ(&heap_t::registry::get(), &h2);
+                for (int i = 0; i < 1000; ++i) l.push_back(i);
+            });
+        t.join();
+        EXPECT_EQ(l.size(), 2000u);
+        EXPECT_EQ(&heap_t::registry::get(), &h);
+    }
+    heap_t::registry::set_global(nullptr);
+}
+
+TEST(heap, span)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+    context c;
+
+    heap_t h(&c);
+
+    const std::size_t    n = 1000;
+    auto                 p = static_cast<heap_t::typed_pointer<double>>(h.allocate(n * 8u, 0));
+    heap_t::span<double> s(p, n);
+    EXPECT_EQ(s.data(), p.get());
+    EXPECT_EQ(s.size_bytes(), n * sizeof(double));
+    EXPECT_EQ(s.handle().ptr, p.get());
+
+    double x = 0;
+    for (auto& v : s) v = x++;
+    EXPECT_EQ(s.back(), n - 1.0);
+
+    // handles of subspans refer to their part of the block
+    auto t = s.subspan(100, 50);
+    EXPECT_EQ(t.size(), 50u);
+    EXPECT_EQ(t.front(), 100.0);
+    EXPECT_EQ(t.handle().ptr, p.get() + 100);
+    EXPECT_EQ(s.subspan(990).size(), 10u);
+    EXPECT_EQ(t.last(10).handle().ptr, p.get() + 140);
+    EXPECT_EQ(t.first(0).size(), 0u);
+
+    heap_t::span<const double> u = t;
+    EXPECT_EQ(u[1], 101.0);
+    p.release();
+
+    // views of user allocations
+    std::vector<int> data(100);
+    auto r = static_cast<heap_t::typed_pointer<int>>(
+        h.register_user_allocation(data.data(), data.size() * sizeof(int)));
+    heap_t::span<int> v(r, data.size());
+    EXPECT_EQ(v.subspan(10, 5).handle().ptr, &data[10]);
+    // sub-pointers of user allocations, and sub-pointers of those
+    auto q = h.sub_pointer(static_cast<heap_t::pointer>(r), 40, 200);
+    EXPECT_EQ(q.handle().ptr, &data[10]);
+    EXPECT_EQ(h.sub_pointer(q, 20, 20).handle().ptr, &data[15]);
+    h.free(q);
+    r.release();
+
+    // views of arena buffers keep their handles
+    heap_t::arena        a(h, 4096, 0);
+    auto                 b = static_cast<heap_t::typed_pointer<double>>(a.allocate(800, 64));
+    heap_t::span<double> w(b, 100);
+    EXPECT_EQ(w.handle().ptr, b.get());
+    EXPECT_EQ(w.subspan(10, 5).handle().ptr, b.get() + 10);
+    EXPECT_EQ(w.subspan(10).subspan(20).handle().ptr, b.get() + 30);
+}
+
 TEST(heap, user_allocation)
 {
     using heap_t = hwmalloc::heap<context>;
@@ -0,0 +1,561 @@
+/*
+ * ghex-org
+ *
+ * Copyright (c) 2014-2023, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <gtest/gtest.h>
+
+#include <hwmalloc/heap.hpp>
+
+#include <atomic>
+#include <list>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+// runs with HWMALLOC_NUMA_TOPOLOGY pointing to topology.txt
+
+struct context
+{
+    struct region
+    {
+        struct handle_type
+        {
+            void* ptr;
+        };
+
+        void* ptr = nullptr;
+
+        region(void* p) noexcept
+        : ptr{p}
+        {
+        }
+
+        region(region const&) = delete;
+
+        region(region&& other) noexcept
+        : ptr{std::exchange(other.ptr, nullptr)}
+        {
+        }
+
+        handle_type get_handle(std::size_t offset, std::size_t /*size*/) const noexcept
+        {
+            return {(void*)((char*)ptr + offset)};
+        }
+    };
+};
+
+auto
+register_memory(context&, void* ptr, std::size_t)
+{
+    return context::region{ptr};
+}
+
+// context whose registrations pin the memory
+struct pinning_context : context
+{
+    int num_registrations = 0;
+};
+
+auto
+register_memory(pinning_context& c, void* ptr, std::size_t)
+{
+    ++c.num_registrations;
+    return context::region{ptr};
+}
+
+bool
+requires_reregistration(pinning_context const&)
+{
+    return true;
+}
+
+constexpr std::size_t MB = 1u << 20;
+
+TEST(topology, discover)
+{
+    using namespace hwmalloc;
+    using tier = numa_tools::memory_tier;
+    using nodes = std::vector<numa_tools::index_type>;
+
+    ASSERT_TRUE(numa().is_simulated());
+    EXPECT_TRUE(numa().is_initialized());
+
+    EXPECT_EQ(numa().host_nodes().size(), 2u);
+    EXPECT_EQ(numa().local_nodes().size(), 2u);
+    EXPECT_EQ(numa().device_nodes().size(), 2u);
+    EXPECT_TRUE(numa().can_allocate_on(1));
+    EXPECT_FALSE(numa().can_allocate_on(2));
+
+    EXPECT_EQ(numa().distance(0, 1), 21);
+    EXPECT_EQ(numa().distance(1, 0), 21);
+    EXPECT_EQ(numa().distance(2, 2), 10);
+    EXPECT_EQ(numa().nearest_nodes(0), (nodes{0, 2, 1, 3}));
+    EXPECT_EQ(numa().nearest_nodes(1), (nodes{1, 0, 2, 3}));
+
+    // node 2 is classified by its distances, node 3 explicitly
+    EXPECT_EQ(numa().tier_of(0), tier::dram);
+    EXPECT_EQ(numa().tier_of(2), tier::hbm);
+    EXPECT_EQ(numa().tier_of(3), tier::cxl);
+
+    auto it = numa().local_nodes().find(numa().local_node());
+    ASSERT_TRUE(it != numa().local_nodes().end());
+    EXPECT_EQ(it->second, numa().local_node_index());
+
+    EXPECT_EQ(numa().num_cache_domains(0), 2u);
+    EXPECT_EQ(numa().num_cache_domains(1), 1u);
+    EXPECT_EQ(numa().num_cache_domains(2), 1u);
+    EXPECT_LT(numa().cache_domain(), numa().num_cache_domains(numa().local_node()));
+}
+
+TEST(topology, allocate)
+{
+    using namespace hwmalloc;
+    using placement = numa_tools::placement;
+
+    const auto pages = MB / numa().page_size();
+    EXPECT_EQ(numa().free_memory(1), 64 * MB);
+
+    // bookkeeping follows the simulated node
+    auto a = numa().allocate(pages, 1, placement::bind);
+    ASSERT_TRUE(a);
+    EXPECT_EQ(a.node, 1u);
+    EXPECT_EQ(numa().get_node(a.ptr), 1u);
+    EXPECT_EQ(numa().get_node((char*)a.ptr + MB - 1), 1u);
+    EXPECT_EQ(numa().free_memory(1), 63 * MB);
+    numa().free(a);
+    EXPECT_EQ(numa().free_memory(1), 64 * MB);
+
+    // capacity is enforced for bind and honoured for preferred
+    EXPECT_FALSE(numa().allocate(9 * pages, 2, placement::bind));
+    auto b = numa().allocate(9 * pages, 2, placement::preferred);
+    ASSERT_TRUE(b);
+    EXPECT_EQ(b.node, 0u);
+    EXPECT_EQ(numa().get_node(b.ptr), 0u);
+    numa().free(b);
+
+    // cpu-less nodes are not available for onnode allocations
+    auto c = numa().allocate(pages, 2);
+    ASSERT_TRUE(c);
+    EXPECT_EQ(c.node, numa().local_node());
+    numa().free(c);
+
+    // interleaved memory is charged to all nodes
+    auto d = numa().allocate_interleaved(2 * pages, {0, 1});
+    ASSERT_TRUE(d);
+    EXPECT_EQ(d.node, 0u);
+    EXPECT_EQ(numa().free_memory(0), 63 * MB);
+    EXPECT_EQ(numa().free_memory(1), 63 * MB);
+    numa().free(d);
+    EXPECT_EQ(numa().free_memory(0), 64 * MB);
+}
+
+TEST(topology, memory_tier)
+{
+    using heap_t = hwmalloc::heap<context>;
+    using tier = hwmalloc::numa_tools::memory_tier;
+
+    context c;
+    heap_t  h(&c);
+
+    // the 8M hbm node holds two 4M segments, the third one spills to dram
+    std::vector<heap_t::pointer> ptrs;
+    for (int i = 0; i < 3; ++i) ptrs.push_back(h.allocate(4 * MB, 0, tier::hbm));
+    EXPECT_EQ(hwmalloc::numa().get_node(ptrs[0].get()), 2u);
+    EXPECT_EQ(hwmalloc::numa().get_node(ptrs[1].get()), 2u);
+    EXPECT_EQ(hwmalloc::numa().get_node(ptrs[2].get()), 0u);
+    for (auto& p : ptrs) h.free(p);
+}
+
+TEST(topology, memory_tier_full)
+{
+    using heap_t = hwmalloc::heap<context>;
+    using pool_t = hwmalloc::detail::pool<context>;
+    using tier = hwmalloc::numa_tools::memory_tier;
+    using placement = hwmalloc::numa_tools::placement;
+
+    context c;
+    heap_t  h(&c);
+
+    const auto page_size = hwmalloc::numa().page_size();
+
+    // the hbm node is filled by someone else: blocks spill to dram
+    auto a = hwmalloc::numa().allocate(6 * MB / page_size, 2, placement::bind);
+    ASSERT_TRUE(a);
+    auto p = h.allocate(4 * MB, 0, tier::hbm);
+    EXPECT_EQ(hwmalloc::numa().get_node(p.get()), 0u);
+    h.free(p);
+    hwmalloc::numa().free(a);
+    p = h.allocate(4 * MB, 0, tier::hbm);
+    EXPECT_EQ(hwmalloc::numa().get_node(p.get()), 2u);
+    h.free(p);
+
+    // the capacity check passes but the segment cannot be allocated (here: its interleaved half on
+    // the full cxl node): try_allocate reports the failure instead of throwing
+    hwmalloc::heap_config config;
+    config.numa_placement = placement::interleave;
+    config.interleave_nodes = {2, 3};
+    pool_t             pl(&c, 4 * MB, 4 * MB, 2, config);
+    const auto         used = hwmalloc::numa().free_memory(3) / page_size - MB / page_size;
+    auto               b = hwmalloc::numa().allocate(used, 3, placement::bind);
+    pool_t::block_type x;
+    ASSERT_TRUE(b);
+    EXPECT_NO_THROW(EXPECT_FALSE(pl.try_allocate(x)));
+    hwmalloc::numa().free(b);
+    ASSERT_TRUE(pl.try_allocate(x));
+    x.release();
+}
+
+TEST(topology, reallocate_tier)
+{
+    using heap_t = hwmalloc::heap<context>;
+    using tier = hwmalloc::numa_tools::memory_tier;
+
+    context c;
+    heap_t  h(&c);
+
+    // a block on the hbm node next to socket 0 stays there when it is reallocated by a thread on
+    // socket 1 (if the machine has a cpu which is mapped to it)
+    std::thread t(
+        [&]()
+        {
+#ifdef __linux__
+            const auto num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+            for (long cpu = 0; cpu < num_cpus && hwmalloc::numa().local_node() != 1u; ++cpu)
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                sched_setaffinity(0, sizeof(set), &set);
+            }
+#endif
+            auto p = h.allocate(1000, 0, tier::hbm);
+            EXPECT_EQ(hwmalloc::numa().get_node(p.get()), 2u);
+            p = h.reallocate(p, 100000);
+            EXPECT_EQ(hwmalloc::numa().get_node(p.get()), 2u);
+            h.free(p);
+        });
+    t.join();
+}
+
+TEST(topology, local_allocator_node)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+    context c;
+    heap_t  h(&c);
+    heap_t::registry::set_global(&h);
+
+    // nodes bound through the registry: globally, and overridden by a thread
+    heap_t::registry::set_global_node(1);
+    {
+        std::list<int, heap_t::local_allocator_type<int>> l;
+        l.push_back(1);
+        EXPECT_EQ(hwmalloc::numa().get_node(&l.back()), 1u);
+        std::thread t(
+            [&]()
+            {
+                heap_t::registry::set_local_node(0);
+                l.push_back(2);
+                EXPECT_EQ(hwmalloc::numa().get_node(&l.back()), 0u);
+            });
+        t.join();
+        std::vector<double, heap_t::local_allocator_type<double>> v(1000);
+        EXPECT_EQ(hwmalloc::numa().get_node(v.data()), 1u);
+    }
+    heap_t::registry::set_global_node(heap_t::registry::any_node);
+    heap_t::registry::set_global(nullptr);
+}
+
+TEST(topology, numa_fallback)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+    context c;
+
+    hwmalloc::heap_config config;
+    config.numa_placement = hwmalloc::numa_tools::placement::bind;
+    config.numa_fallback = true;
+    heap_t h(&c, config);
+
+    // node 0 fills up after 15 segments (the pools' metadata takes a few of its pages), the next
+    // one goes to the nearest dram node (node 1) and not to the closer hbm node
+    std::vector<heap_t::pointer> ptrs;
+    for (int i = 0; i < 16; ++i) ptrs.push_back(h.allocate(4 * MB, 0));
+    EXPECT_EQ(hwmalloc::numa().get_node(ptrs[14].get()), 0u);
+    EXPECT_EQ(hwmalloc::numa().get_node(ptrs[15].get()), 1u);
+    EXPECT_EQ(h.num_fallback_segments(), 1u);
+    for (auto& p : ptrs) h.free(p);
+}
+
+TEST(topology, cache_domain_shards)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+    context c;
+    heap_t  h(&c);
+
+    // node 0 pools are split into two shards, blocks freed by other threads are found again
+    std::vector<heap_t::pointer> ptrs;
+    for (int i = 0; i < 1000; ++i) ptrs.push_back(h.allocate(32, 0));
+    std::thread t(
+        [&]()
+        {
+            for (auto& p : ptrs) h.free(p);
+        });
+    t.join();
+    for (auto& p : ptrs) p = h.allocate(32, 0);
+    for (auto& p : ptrs) EXPECT_EQ(hwmalloc::numa().get_node(p.get()), 0u);
+    for (auto& p : ptrs) h.free(p);
+}
+
+TEST(topology, migrate)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+    context c;
+    heap_t  h(&c);
+
+    auto a = h.allocate(1 * MB, 0);
+    auto b = h.allocate(100, 0);
+    new (a.get()) int(42);
+    EXPECT_EQ(h.migrate(0, 1), 2u);
+    EXPECT_EQ(hwmalloc::numa().get_node(a.get()), 1u);
+    EXPECT_EQ(hwmalloc::numa().get_node(b.get()), 1u);
+    EXPECT_EQ(*static_cast<int*>(a.get()), 42);
+    EXPECT_EQ(h.migrate(0, 1), 0u);
+    h.free(a);
+    h.free(b);
+
+    // the migrated segments now serve node 1
+    auto d = h.allocate(100, 1);
+    EXPECT_EQ(hwmalloc::numa().get_node(d.get()), 1u);
+    h.free(d);
+}
+
+TEST(topology, migrate_concurrent_free)
+{
+    using pool_t = hwmalloc::detail::pool<context>;
+    using block_t = pool_t::block_type;
+
+    context c;
+
+    // pools on nodes 0 and 1 sharing their segments, 16 blocks per segment
+    hwmalloc::heap_config config;
+    const auto            segment_size = 4 * hwmalloc::numa().page_size();
+    const auto            block_size = segment_size / 16;
+    auto                  table = pool_t::make_segment_table(block_size, segment_size, config);
+    pool_t                p0(&c, block_size, segment_size, 0, config, table);
+    pool_t                p1(&c, block_size, segment_size, 1, config, table);
+
+    // a free which looked up the pool of its block before the block's segment was migrated
+    {
+        std::vector<block_t> blocks(3 * 16);
+        for (auto& b : blocks) b = p0.allocate();
+        // the first segment is retired, the other two are migrated with all blocks in use
+        for (std::size_t i = 0; i < 16u; ++i) blocks[i].release();
+        EXPECT_EQ(p0.migrate(p1), 2u);
+        // new segments for the old pool
+        std::vector<block_t> more(2 * 16);
+        for (auto& b : more) b = p0.allocate();
+        // the last block of the second segment is freed on the old pool: the segment is retired
+        // on the pool owning it now
+        for (std::size_t i = 16u; i < 31u; ++i) blocks[i].release();
+        p0.free(blocks[31]);
+        EXPECT_EQ(p0.num_segments(), 2u);
+        EXPECT_EQ(p1.num_segments(), 1u);
+        EXPECT_EQ(p1.migrate(p0), 1u);
+        for (std::size_t i = 32u; i < 48u; ++i) blocks[i].release();
+        for (auto& b : more) b.release();
+    }
+
+    // segments are migrated back and forth while other threads free their blocks: the frees
+    // retire the segments on the pools owning them
+    for (int round = 0; round < 10; ++round)
+    {
+        std::vector<block_t> blocks(64 * 16);
+        for (auto& b : blocks) b = p0.allocate();
+        std::atomic<bool>        done{false};
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; ++i)
+            threads.emplace_back(
+                [&, i]()
+                {
+                    for (std::size_t j = i; j < blocks.size(); j += 4) blocks[j].release();
+                });
+        std::thread m(
+            [&]()
+            {
+                while (!done)
+                {
+                    p0.migrate(p1);
+                    p1.migrate(p0);
+                }
+            });
+        for (auto& t : threads) t.join();
+        done = true;
+        m.join();
+
+        // the counts match the segments which can be moved (retired segments are not)
+        EXPECT_LE(p0.num_segments() + p1.num_segments(), 64u);
+        const auto n1 = p1.num_segments();
+        EXPECT_EQ(p1.migrate(p0), n1);
+        const auto n0 = p0.num_segments();
+        EXPECT_EQ(p0.migrate(p1), n0);
+        EXPECT_EQ(p1.migrate(p0), n0);
+        EXPECT_EQ(p1.num_segments(), 0u);
+    }
+}
+
+TEST(topology, migrate_reregister)
+{
+    using heap_t = hwmalloc::heap<pinning_context>;
+
+    pinning_context c;
+
+    hwmalloc::heap_config config;
+    config.num_reserve_segments = 2;
+    heap_t h(&c, config);
+
+    // a's segment is in use and stays, b's segment is free and is moved
+    auto a = h.allocate(1 * MB, 0);
+    auto b = h.allocate(1 * MB, 0);
+    h.free(b);
+    EXPECT_EQ(c.num_registrations, 2);
+    EXPECT_EQ(h.migrate(0, 1), 1u);
+    EXPECT_EQ(c.num_registrations, 3);
+    EXPECT_EQ(hwmalloc::numa().get_node(a.get()), 0u);
+
+    auto d = h.allocate(1 * MB, 1);
+    EXPECT_EQ(hwmalloc::numa().get_node(d.get()), 1u);
+    EXPECT_EQ(c.num_registrations, 3);
+    h.free(d);
+    h.free(a);
+}
+
+TEST(topology, node_arena)
+{
+    using namespace hwmalloc;
+
+    // metadata of cpu-less nodes lives on the nearest node with cpus
+    EXPECT_EQ(detail::metadata_node(1), 1u);
+    EXPECT_EQ(detail::metadata_node(2), 0u);
+    EXPECT_EQ(detail::metadata_node(3), 0u);
+
+    const auto         free_memory = numa().free_memory(1);
+    detail::node_arena arena(1);
+    void*              p = arena.allocate(100);
+    void*              q = arena.allocate(64, 64);
+    void*              r = arena.allocate(10000);
+    EXPECT_EQ(numa().get_node(p), 1u);
+    EXPECT_EQ(numa().get_node(q), 1u);
+    EXPECT_EQ(numa().get_node(r), 1u);
+    EXPECT_EQ((std::uintptr_t)q % 64, 0u);
+    // one page for the small allocations, and the large one rounded up to whole pages
+    const auto page_size = numa().page_size();
+    const auto num_pages = (10000 + page_size - 1) / page_size + 1;
+    EXPECT_EQ(numa().free_memory(1), free_memory - num_pages * page_size);
+
+    // freed blocks are reused
+    arena.deallocate(p, 100);
+    EXPECT_EQ(arena.allocate(112), p);
+    arena.deallocate(r, 10000);
+    EXPECT_EQ(numa().free_memory(1), free_memory - page_size);
+}
+
+TEST(topology, epoch_reclamation)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+    context c;
+    heap_t  h(&c);
+
+    auto       a = h.allocate(1 * MB, 0);
+    auto       b = h.allocate(1 * MB, 0);
+    const auto free_memory = hwmalloc::numa().free_memory(0);
+
+    // a thread inside a critical section keeps retired segments alive
+    std::atomic<int> state{0};
+    std::thread      t(
+        [&state]()
+        {
+            hwmalloc::detail::epoch_guard g;
+            state = 1;
+            while (state != 2) std::this_thread::yield();
+        });
+    while (state != 1) std::this_thread::yield();
+    h.free(a);
+    EXPECT_EQ(hwmalloc::numa().free_memory(0), free_memory);
+    state = 2;
+    t.join();
+
+    // b's segment is kept as reserve, a's segment is destroyed on the way
+    h.free(b);
+    EXPECT_EQ(hwmalloc::numa().free_memory(0), free_memory + 1 * MB);
+}
+
+TEST(topology, remote_free_batch)
+{
+    using heap_t = hwmalloc::heap<context>;
+
+#ifdef __linux__
+    // stay on one simulated node
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(sched_getcpu(), &set);
+    sched_setaffinity(0, sizeof(set), &set);
+#endif
+    const auto remote = hwmalloc::numa().local_node() == 0u ? 1u : 0u;
+
+    context c;
+
+    hwmalloc::heap_config config;
+    config.remote_free_batch = 2;
+    heap_t h(&c, config);
+
+    // measured after the first allocation, which also creates the metadata of the 1M pools
+    auto       a = h.allocate(1 * MB, remote);
+    const auto free_memory = hwmalloc::numa().free_memory(remote) + 1 * MB;
+    auto       b = h.allocate(1 * MB, remote);
+    auto       d = h.allocate(1 * MB, remote);
+    EXPECT_EQ(hwmalloc::numa().free_memory(remote), free_memory - 3 * MB);
+
+    // a is buffered, b completes the batch: the empty segments are released down to the reserve
+    h.free(a);
+    EXPECT_EQ(hwmalloc::numa().free_memory(remote), free_memory - 3 * MB);
+    h.free(b);
+    EXPECT_EQ(hwmalloc::numa().free_memory(remote), free_memory - 1 * MB);
+
+    // d is buffered and cannot be reused yet
+    h.free(d);
+    auto x = h.allocate(1 * MB, remote);
+    EXPECT_EQ(hwmalloc::numa().free_memory(remote), free_memory - 2 * MB);
+    auto y = h.allocate(1 * MB, remote);
+    EXPECT_EQ(hwmalloc::numa().free_memory(remote), free_memory - 3 * MB);
+
+    h.free(x);
+    EXPECT_EQ(hwmalloc::numa().free_memory(remote), free_memory - 1 * MB);
+
+    // explicit flush
+    auto z = h.allocate(1 * MB, remote);
+    h.free(z);
+    EXPECT_EQ(hwmalloc::numa().free_memory(remote), free_memory - 2 * MB);
+    h.flush_remote_frees();
+    EXPECT_EQ(hwmalloc::numa().free_memory(remote), free_memory - 1 * MB);
+
+    // buffers are flushed when a thread exits
+    auto e = h.allocate(1 * MB, remote);
+    EXPECT_EQ(hwmalloc::numa().free_memory(remote), free_memory - 2 * MB);
+    std::thread t([&]() { h.free(e); });
+    t.join();
+    EXPECT_EQ(hwmalloc::numa().free_memory(remote), free_memory - 1 * MB);
+    h.free(y);
+    h.flush_remote_frees();
+}
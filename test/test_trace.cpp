@@ -0,0 +1,143 @@
+/*
+ * ghex-org
+ *
+ * Copyright (c) 2014-2023, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <gtest/gtest.h>
+
+#include <hwmalloc/heap.hpp>
+#include <hwmalloc/trace.hpp>
+
+#include <sstream>
+#include <string>
+#include <thread>
+
+struct context
+{
+    struct region
+    {
+        struct handle_type
+        {
+            void* ptr;
+        };
+
+        void* ptr = nullptr;
+
+        region(void* p) noexcept
+        : ptr{p}
+        {
+        }
+
+        region(region const&) = delete;
+
+        region(region&& other) noexcept
+        : ptr{std::exchange(other.ptr, nullptr)}
+        {
+        }
+
+        handle_type get_handle(std::size_t offset, std::size_t /*size*/) const noexcept
+        {
+            return {(void*)((char*)ptr + offset)};
+        }
+    };
+};
+
+auto
+register_memory(context&, void* ptr, std::size_t)
+{
+    return context::region{ptr};
+}
+
+std::size_t
+count(std::string const& str, std::string const& pattern)
+{
+    std::size_t n = 0;
+    for (auto pos = str.find(pattern); pos != std::string::npos; pos = str.find(pattern, pos + 1))
+        ++n;
+    return n;
+}
+
+// top level object of the chrome trace format with one event object per line
+bool
+well_formed(std::string const& str)
+{
+    const std::string head = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    const std::string tail = "\n]}\n";
+    if (str.compare(0, head.size(), head) != 0) return false;
+    if (str.size() < head.size() + tail.size()) return false;
+    if (str.compare(str.size() - tail.size(), tail.size(), tail) != 0) return false;
+    long depth = 0;
+    for (auto c : str)
+    {
+        if (c == '{') ++depth;
+        else if (c == '}')
+            --depth;
+        if (depth < 0) return false;
+    }
+    return depth == 0;
+}
+
+TEST(trace, record)
+{
+    using namespace hwmalloc;
+
+    trace::clear();
+    trace::record(trace::event::budget, 8, 0);
+    std::thread t([]() { trace::record(trace::event::budget, 16, 1); });
+    t.join();
+
+    std::stringstream str;
+    trace::write_chrome_trace(str);
+    const auto s = str.str();
+    EXPECT_TRUE(well_formed(s));
+    EXPECT_EQ(count(s, "{\"name\":"), 2u);
+    EXPECT_EQ(count(s, "\"name\":\"budget\""), 2u);
+    EXPECT_EQ(count(s, "\"numa_node\":1"), 1u);
+    // one event per thread
+    const auto first = s.find("\"tid\":") + 6;
+    const auto last = s.rfind("\"tid\":") + 6;
+    EXPECT_NE(std::stol(s.substr(first)), std::stol(s.substr(last)));
+
+    // threads which come and go reuse the buffers of exited threads
+    trace::clear();
+    for (int i = 0; i < 4; ++i)
+    {
+        std::thread t([i]() { trace::record(trace::event::budget, 32, 10 + i); });
+        t.join();
+    }
+    str.str("");
+    trace::write_chrome_trace(str);
+    const auto s2 = str.str();
+    EXPECT_TRUE(well_formed(s2));
+    EXPECT_EQ(count(s2, "{\"name\":"), 1u);
+    EXPECT_EQ(count(s2, "\"numa_node\":13"), 1u);
+}
+
+TEST(trace, heap)
+{
+    using heap_t = hwmalloc::heap<context>;
+    using namespace hwmalloc;
+
+    trace::clear();
+    {
+        context c;
+        heap_t  h(&c);
+        auto    ptr = h.allocate(1 << 20, 0);
+        h.free(ptr);
+    }
+
+    std::stringstream str;
+    trace::write_chrome_trace(str);
+    const auto s = str.str();
+    EXPECT_TRUE(well_formed(s));
+    EXPECT_EQ(count(s, "\"name\":\"segment_add\""), 1u);
+    EXPECT_EQ(count(s, "\"name\":\"segment_remove\""), 1u);
+    EXPECT_EQ(count(s, "\"name\":\"register\",\"cat\":\"hwmalloc\",\"ph\":\"B\""), 1u);
+    EXPECT_EQ(count(s, "\"name\":\"register\",\"cat\":\"hwmalloc\",\"ph\":\"E\""), 1u);
+    EXPECT_EQ(count(s, "\"name\":\"slow_path\",\"cat\":\"hwmalloc\",\"ph\":\"B\""), 1u);
+    EXPECT_EQ(count(s, "\"name\":\"slow_path\",\"cat\":\"hwmalloc\",\"ph\":\"E\""), 1u);
+}